@@ -3,8 +3,15 @@
 #include <math.h>
 
 #include "batch_buffer.h"
-
-#define LEAKY_RELU_LEAK 0.01
+#include "fast_math.h"
+#include "activation_table.h"
+
+// Defines the whole-layer version of a tiled activation function.
+#define WHOLE_LAYER(name) \
+    static void name(batch_buffer_layer_data *layer) \
+    { \
+        name##_tile(layer, 0, layer->output_size); \
+    }
 
 static void identity(batch_buffer_layer_data *layer)
 {
@@ -16,107 +23,139 @@ static void identity_derivative(batch_buffer_layer_data *layer)
     (void)layer;
 }
 
-static void sigmoid(batch_buffer_layer_data *layer)
+static void sigmoid_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
-        layer->activations[neuron] = 1 / (1 + exp(-layer->preactivation_sums[neuron]));
+    vector_sigmoid(layer->activations + begin, layer->preactivation_sums + begin, end - begin);
 }
+WHOLE_LAYER(sigmoid)
 
-static void sigmoid_derivative(batch_buffer_layer_data *layer)
+static void sigmoid_derivative_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
+    for (size_t neuron = begin; neuron < end; ++neuron)
     {
         double s = layer->activations[neuron];
         layer->local_gradients[neuron] *= s * (1 - s);
     }
 }
+WHOLE_LAYER(sigmoid_derivative)
 
-static void tanh_layer(batch_buffer_layer_data *layer)
+static void tanh_layer_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
-    {
-        double x = layer->preactivation_sums[neuron];
-        layer->activations[neuron] = tanh(x);
-    }
+    vector_tanh(layer->activations + begin, layer->preactivation_sums + begin, end - begin);
 }
+WHOLE_LAYER(tanh_layer)
 
-static void tanh_derivative(batch_buffer_layer_data *layer)
+static void tanh_derivative_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
+    for (size_t neuron = begin; neuron < end; ++neuron)
     {
         double t = layer->activations[neuron];
         layer->local_gradients[neuron] *= 1 - t * t;
     }
 }
+WHOLE_LAYER(tanh_derivative)
 
-static void relu(batch_buffer_layer_data *layer)
+// The sign mask is written a whole word at a time: tiles start at multiples of SIGN_MASK_WORD_BITS.
+static void relu_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
+    for (size_t word = begin / SIGN_MASK_WORD_BITS; word * SIGN_MASK_WORD_BITS < end; ++word)
     {
-        double x = layer->preactivation_sums[neuron];
-        layer->activations[neuron] = 0 < x ? x : 0;
+        size_t word_begin = word * SIGN_MASK_WORD_BITS;
+        size_t word_end = word_begin + SIGN_MASK_WORD_BITS < end ? word_begin + SIGN_MASK_WORD_BITS : end;
+        uint64_t bits = 0;
+        for (size_t neuron = word_begin; neuron < word_end; ++neuron)
+        {
+            double x = layer->preactivation_sums[neuron];
+            layer->activations[neuron] = 0 < x ? x : 0;
+            bits |= (uint64_t)(0 < x) << (neuron - word_begin);
+        }
+        layer->sign_mask[word] = bits;
     }
 }
+WHOLE_LAYER(relu)
 
-static void relu_derivative(batch_buffer_layer_data *layer)
+static void relu_derivative_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
-        layer->local_gradients[neuron] *= 0 < layer->preactivation_sums[neuron] ? 1 : 0;
+    for (size_t neuron = begin; neuron < end; ++neuron)
+        layer->local_gradients[neuron] *= sign_mask_get(layer->sign_mask, neuron) ? 1 : 0;
 }
+WHOLE_LAYER(relu_derivative)
 
-static void leaky_relu(batch_buffer_layer_data *layer)
+static void leaky_relu_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
+    for (size_t word = begin / SIGN_MASK_WORD_BITS; word * SIGN_MASK_WORD_BITS < end; ++word)
     {
-        double slope = 0 < layer->preactivation_sums[neuron] ? LEAKY_RELU_LEAK : 0;
-        layer->activations[neuron] = slope * layer->preactivation_sums[neuron];
+        size_t word_begin = word * SIGN_MASK_WORD_BITS;
+        size_t word_end = word_begin + SIGN_MASK_WORD_BITS < end ? word_begin + SIGN_MASK_WORD_BITS : end;
+        uint64_t bits = 0;
+        for (size_t neuron = word_begin; neuron < word_end; ++neuron)
+        {
+            double x = layer->preactivation_sums[neuron];
+            double slope = 0 < x ? LEAKY_RELU_LEAK : 0;
+            layer->activations[neuron] = slope * x;
+            bits |= (uint64_t)(0 < x) << (neuron - word_begin);
+        }
+        layer->sign_mask[word] = bits;
     }
 }
+WHOLE_LAYER(leaky_relu)
 
-static void leaky_relu_derivative(batch_buffer_layer_data *layer)
+static void leaky_relu_derivative_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
-        layer->local_gradients[neuron] *= 0 < layer->preactivation_sums[neuron] ? LEAKY_RELU_LEAK : 1;
+    for (size_t neuron = begin; neuron < end; ++neuron)
+        layer->local_gradients[neuron] *= sign_mask_get(layer->sign_mask, neuron) ? LEAKY_RELU_LEAK : 1;
 }
+WHOLE_LAYER(leaky_relu_derivative)
 
-static void swish(batch_buffer_layer_data *layer)
+static void swish_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
-    {
-        double x = layer->preactivation_sums[neuron];
-        layer->activations[neuron] = x / (1 + exp(-x));   
-    }
+    vector_swish(layer->activations + begin, layer->preactivation_sums + begin, end - begin);
 }
+WHOLE_LAYER(swish)
 
-static void swish_derivative(batch_buffer_layer_data *layer)
+static void swish_derivative_tile(batch_buffer_layer_data *layer, size_t begin, size_t end)
 {
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
+    #pragma omp simd
+    for (size_t neuron = begin; neuron < end; ++neuron)
     {
+        // The sigmoid is recovered from y = x * sigmoid(x) instead of being recomputed.
         double y = layer->activations[neuron];
         double x = layer->preactivation_sums[neuron];
-        double s = 1 / (1 + exp(-x));
+        double s = x != 0 ? y / x : 0.5;
         layer->local_gradients[neuron] *= y + s * (1 - y);
     }
 }
+WHOLE_LAYER(swish_derivative)
+
+static void sigmoid_table(batch_buffer_layer_data *layer)
+{
+    table_sigmoid(layer->activations, layer->preactivation_sums, layer->output_size);
+}
+
+static void tanh_table(batch_buffer_layer_data *layer)
+{
+    table_tanh(layer->activations, layer->preactivation_sums, layer->output_size);
+}
+
+static void swish_table(batch_buffer_layer_data *layer)
+{
+    table_swish(layer->activations, layer->preactivation_sums, layer->output_size);
+}
 
 static void softmax(batch_buffer_layer_data *layer)
 {
     // To avoid numerical instability, we subtract the maximum value from the preactivation sums.
     double max = layer->preactivation_sums[0];
+    #pragma omp simd reduction(max:max)
     for (size_t neuron = 1; neuron < layer->output_size; ++neuron)
-        if (layer->preactivation_sums[neuron] > max)
-            max = layer->preactivation_sums[neuron];
-    
-    double sum = 0;
-    for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
-    {
-        double x = exp(layer->preactivation_sums[neuron] - max);
-        layer->activations[neuron] = x;
-        sum += x;
-    }
-    
+        max = fmax(max, layer->preactivation_sums[neuron]);
+
+    double sum = vector_exp_shifted_sum(layer->activations, layer->preactivation_sums, max, layer->output_size);
+
+    double inverse_sum = 1 / sum;
+    #pragma omp simd
     for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
-        layer->activations[neuron] /= sum;
+        layer->activations[neuron] *= inverse_sum;
 }
 
 static void softmax_derivative(batch_buffer_layer_data *layer)
@@ -125,10 +164,45 @@ static void softmax_derivative(batch_buffer_layer_data *layer)
     (void)layer;
 }
 
-const activation_pair activation_linear = {identity, identity_derivative};
-const activation_pair activation_sigmoid = {sigmoid, sigmoid_derivative};
-const activation_pair activation_tanh = {tanh_layer, tanh_derivative};
-const activation_pair activation_relu = {relu, relu_derivative};
-const activation_pair activation_leaky_relu = {leaky_relu, leaky_relu_derivative};
-const activation_pair activation_swish = {swish, swish_derivative};
-const activation_pair activation_softmax = {softmax, softmax_derivative};
+const activation_pair activation_linear = {
+    identity, identity_derivative, NULL, NULL, NULL, ACTIVATION_ALIASES_PREACTIVATIONS
+};
+const activation_pair activation_sigmoid = {
+    sigmoid, sigmoid_derivative, sigmoid_tile, sigmoid_derivative_tile, sigmoid_table, ACTIVATION_KEEPS_OUTPUT
+};
+const activation_pair activation_tanh = {
+    tanh_layer, tanh_derivative, tanh_layer_tile, tanh_derivative_tile, tanh_table, ACTIVATION_KEEPS_OUTPUT
+};
+const activation_pair activation_relu = {
+    relu, relu_derivative, relu_tile, relu_derivative_tile, NULL, ACTIVATION_KEEPS_SIGN_MASK
+};
+const activation_pair activation_leaky_relu = {
+    leaky_relu, leaky_relu_derivative, leaky_relu_tile, leaky_relu_derivative_tile, NULL, ACTIVATION_KEEPS_SIGN_MASK
+};
+const activation_pair activation_swish = {
+    swish, swish_derivative, swish_tile, swish_derivative_tile, swish_table, ACTIVATION_KEEPS_PREACTIVATIONS
+};
+const activation_pair activation_softmax = {
+    softmax, softmax_derivative, NULL, NULL, NULL, ACTIVATION_KEEPS_OUTPUT
+};
+
+static const struct {
+    const activation_pair *pair;
+    const char *name;
+} activation_names[] = {
+    { &activation_linear, "Linear" },
+    { &activation_sigmoid, "Sigmoid" },
+    { &activation_tanh, "Tanh" },
+    { &activation_relu, "ReLU" },
+    { &activation_leaky_relu, "LeakyReLU" },
+    { &activation_swish, "Swish" },
+    { &activation_softmax, "Softmax" }
+};
+
+const char* activation_name(const activation_pair *pair)
+{
+    for (size_t idx = 0; idx < sizeof(activation_names) / sizeof(*activation_names); ++idx)
+        if (activation_names[idx].pair->base == pair->base)
+            return activation_names[idx].name;
+    return "Unknown";
+}
@@ -2,14 +2,43 @@
 #define ACTIVATION_H
 
 #include <math.h>
+#include <stddef.h>
 
 typedef struct batch_buffer_layer_data batch_buffer_layer_data;
 
+#define LEAKY_RELU_LEAK 0.01
+
+// What the derivative needs from the forward pass besides the activations, so that the
+// memory planner of batch_buffer.c keeps nothing more.
+typedef enum activation_storage {
+    ACTIVATION_KEEPS_OUTPUT,           // The activations only
+    ACTIVATION_KEEPS_PREACTIVATIONS,   // The preactivation sums too
+    ACTIVATION_KEEPS_SIGN_MASK,        // One bit per neuron: preactivation sum > 0
+    ACTIVATION_ALIASES_PREACTIVATIONS  // The activations are the preactivation sums
+} activation_storage;
+
 typedef struct activation_pair {
     void (*base)(batch_buffer_layer_data *layer);
     void (*derivative)(batch_buffer_layer_data *layer);
+
+    // The same, restricted to neurons [begin, end), so that they can run as the epilogue of
+    // each tile of the layer's matrix product while it is still in cache.
+    // NULL when the activation needs the whole layer (softmax) or does no work per neuron.
+    void (*base_tile)(batch_buffer_layer_data *layer, size_t begin, size_t end);
+    void (*derivative_tile)(batch_buffer_layer_data *layer, size_t begin, size_t end);
+
+    // Inference-only version of base for ACTIVATION_BACKEND_TABLE, NULL when base is already cheap.
+    void (*approximation)(batch_buffer_layer_data *layer);
+
+    activation_storage storage;
 } activation_pair;
 
+// How the activations of a model are evaluated when serving it; training is always exact.
+typedef enum activation_backend {
+    ACTIVATION_BACKEND_EXACT,
+    ACTIVATION_BACKEND_TABLE // Interpolation tables, see activation_table.h
+} activation_backend;
+
 extern const activation_pair activation_linear;
 extern const activation_pair activation_sigmoid;
 extern const activation_pair activation_tanh;
@@ -18,4 +47,7 @@ extern const activation_pair activation_leaky_relu;
 extern const activation_pair activation_swish;
 extern const activation_pair activation_softmax;
 
+// Name of an activation as in the configuration file, "Unknown" for any other pair.
+const char* activation_name(const activation_pair *pair);
+
 #endif // ACTIVATION_H
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include "activation_table.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#define TABLE_STEPS_PER_UNIT 16
+#define SIGMOID_TABLE_RANGE 16 // sigmoid(-16) < 1.2e-7
+#define TANH_TABLE_RANGE 8     // 1 - tanh(8) < 2.3e-7
+#define SIGMOID_INTERVALS (2 * SIGMOID_TABLE_RANGE * TABLE_STEPS_PER_UNIT)
+#define TANH_INTERVALS (2 * TANH_TABLE_RANGE * TABLE_STEPS_PER_UNIT)
+
+// Cubic a + b t + c t^2 + d t^3 over one interval, t in [0, 1].
+typedef struct cubic {
+    double a, b, c, d;
+} cubic;
+
+static cubic sigmoid_table[SIGMOID_INTERVALS];
+static cubic tanh_table[TANH_INTERVALS];
+static pthread_once_t tables_built = PTHREAD_ONCE_INIT;
+
+static double sigmoid(double x)
+{
+    return 1 / (1 + exp(-x));
+}
+
+static double sigmoid_derivative(double x)
+{
+    double s = sigmoid(x);
+    return s * (1 - s);
+}
+
+static double tanh_derivative(double x)
+{
+    double t = tanh(x);
+    return 1 - t * t;
+}
+
+// Hermite interpolation of f from its values and derivatives at both ends of each interval.
+static void build_table(cubic *table, size_t interval_count, double range, double (*f)(double), double (*derivative)(double))
+{
+    double step = 1.0 / TABLE_STEPS_PER_UNIT;
+    for (size_t i = 0; i < interval_count; ++i)
+    {
+        double x0 = -range + i * step, x1 = x0 + step;
+        double p0 = f(x0), p1 = f(x1);
+        double m0 = step * derivative(x0), m1 = step * derivative(x1);
+        table[i] = (cubic) {
+            .a = p0,
+            .b = m0,
+            .c = 3 * (p1 - p0) - 2 * m0 - m1,
+            .d = 2 * (p0 - p1) + m0 + m1
+        };
+    }
+}
+
+static void build_tables(void)
+{
+    build_table(sigmoid_table, SIGMOID_INTERVALS, SIGMOID_TABLE_RANGE, sigmoid, sigmoid_derivative);
+    build_table(tanh_table, TANH_INTERVALS, TANH_TABLE_RANGE, tanh, tanh_derivative);
+}
+
+void activation_tables_build(void)
+{
+    // Networks may be loaded from several threads at once.
+    pthread_once(&tables_built, build_tables);
+}
+
+// Arguments beyond the range take the value at its end.
+static inline double interpolate(const cubic *table, int interval_count, double range, double x)
+{
+    // The upper clamp stays just below the last knot so that the interval index is in bounds.
+    double last = interval_count - 0x1p-20;
+    double position = (x + range) * TABLE_STEPS_PER_UNIT;
+    position = position < 0 ? 0 : (position > last ? last : position);
+    int i = (int)position;
+    double t = position - i;
+    const cubic *p = &table[i];
+    return p->a + t * (p->b + t * (p->c + t * p->d));
+}
+
+void table_sigmoid(double *y, const double *x, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        y[i] = interpolate(sigmoid_table, SIGMOID_INTERVALS, SIGMOID_TABLE_RANGE, x[i]);
+}
+
+void table_tanh(double *y, const double *x, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        y[i] = interpolate(tanh_table, TANH_INTERVALS, TANH_TABLE_RANGE, x[i]);
+}
+
+void table_swish(double *y, const double *x, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        y[i] = x[i] * interpolate(sigmoid_table, SIGMOID_INTERVALS, SIGMOID_TABLE_RANGE, x[i]);
+}
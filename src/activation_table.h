@@ -0,0 +1,24 @@
+#ifndef ACTIVATION_TABLE_H
+#define ACTIVATION_TABLE_H
+
+// Inference-only sigmoid, tanh and swish, evaluated by cubic Hermite interpolation
+// between knots 1/16 apart, precomputed from libm.
+//
+// Measured maximum absolute error against libm, over 10^7 random arguments each:
+//   sigmoid  [-40, 40]   1.2e-7 (saturation beyond |x| = 16)
+//   tanh     [-20, 20]   2.3e-7 (saturation beyond |x| = 8)
+//   swish    [-40, 40]   1.2e-7 * max(1, |x|)
+// Good enough to serve a trained model, not to train one: use the exact kernels for that.
+
+#include <stddef.h>
+
+// Fills the tables; must have been called once before any of the functions below.
+// Later calls do nothing; concurrent calls wait for the first one.
+void activation_tables_build(void);
+
+// y[i] = sigmoid(x[i]), tanh(x[i]) or x[i] * sigmoid(x[i]). y may alias x.
+void table_sigmoid(double *y, const double *x, size_t count);
+void table_tanh(double *y, const double *x, size_t count);
+void table_swish(double *y, const double *x, size_t count);
+
+#endif // ACTIVATION_TABLE_H
@@ -0,0 +1,181 @@
+#include "adafactor.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "layer.h"
+#include "network.h"
+
+// Columns handed to a thread at once when accumulating column statistics.
+#define ADAFACTOR_COLUMN_CHUNK 256
+
+static void adafactor_update_params(optimizer *base, neural_network *network);
+static void adafactor_free(optimizer *base);
+
+const optimizer_type optimizer_adafactor = {
+    .name = "Adafactor",
+    .update_params = adafactor_update_params,
+    .free = adafactor_free
+};
+
+optimizer* adafactor_create(const neural_network *network, double alpha, double epsilon, double decay_exponent, double clip_threshold, double weight_decay)
+{
+    adafactor *optimizer = malloc(sizeof(adafactor));
+    if (!optimizer) return NULL;
+
+    // Per layer: row statistics, column statistics, then an unfactored vector for the biases.
+    size_t state_count = 0, widest_row = 1;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        const layer *this_layer = network->layers[layer_idx];
+        state_count += this_layer->weight_rows + this_layer->weight_columns + this_layer->output_size;
+        if (this_layer->weight_columns > widest_row)
+            widest_row = this_layer->weight_columns;
+    }
+
+    optimizer->column_scratch = malloc(widest_row * sizeof(double));
+    if (!optimizer->column_scratch || optimizer_init(&optimizer->base, &optimizer_adafactor, network->parameter_count, state_count * sizeof(double)))
+    {
+        free(optimizer->column_scratch);
+        free(optimizer);
+        return NULL;
+    }
+
+    optimizer->alpha = alpha;
+    optimizer->epsilon = epsilon;
+    optimizer->decay_exponent = decay_exponent;
+    optimizer->clip_threshold = clip_threshold;
+    optimizer->weight_decay = weight_decay;
+
+    return &optimizer->base;
+}
+
+static void adafactor_free(optimizer *base)
+{
+    adafactor *optimizer = (adafactor*)base;
+    free(optimizer->column_scratch);
+    optimizer_release(base);
+    free(base);
+}
+
+static void update_biases(const adafactor *optimizer, size_t count, double beta2,
+    double *restrict params, double *restrict v, const double *restrict g)
+{
+    double squared_sum = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        v[i] = beta2 * v[i] + (1 - beta2) * (g[i] * g[i] + optimizer->epsilon);
+        double u = g[i] / sqrt(v[i]);
+        squared_sum += u * u;
+    }
+
+    double rms = sqrt(squared_sum / count);
+    double step = optimizer->alpha / fmax(1, rms / optimizer->clip_threshold);
+    for (size_t i = 0; i < count; ++i)
+        params[i] -= step * g[i] / sqrt(v[i]);
+}
+
+static void update_weights(const adafactor *optimizer, size_t rows, size_t columns, double beta2,
+    double *restrict params, double *restrict row_stats, double *restrict column_stats, const double *restrict g)
+{
+    const double epsilon = optimizer->epsilon;
+    double *restrict column_scratch = optimizer->column_scratch;
+    size_t count = rows * columns;
+    bool parallel = count >= OPTIMIZER_PARALLEL_THRESHOLD;
+
+    // Row means of the squared gradient.
+    double row_stat_sum = 0;
+    #pragma omp parallel for schedule(static) reduction(+:row_stat_sum) if(parallel)
+    for (size_t row = 0; row < rows; ++row)
+    {
+        const double *g_row = g + row * columns;
+        double sum = 0;
+        #pragma omp simd reduction(+:sum)
+        for (size_t column = 0; column < columns; ++column)
+            sum += g_row[column] * g_row[column] + epsilon;
+        row_stats[row] = beta2 * row_stats[row] + (1 - beta2) * sum / columns;
+        row_stat_sum += row_stats[row];
+    }
+    double row_stat_mean = row_stat_sum / rows;
+
+    // Column means of the squared gradient, then their inverse square roots.
+    size_t chunk_count = (columns + ADAFACTOR_COLUMN_CHUNK - 1) / ADAFACTOR_COLUMN_CHUNK;
+    #pragma omp parallel for schedule(static) if(parallel)
+    for (size_t chunk = 0; chunk < chunk_count; ++chunk)
+    {
+        size_t begin = chunk * ADAFACTOR_COLUMN_CHUNK;
+        size_t end = begin + ADAFACTOR_COLUMN_CHUNK < columns ? begin + ADAFACTOR_COLUMN_CHUNK : columns;
+        for (size_t column = begin; column < end; ++column)
+            column_scratch[column] = 0;
+        for (size_t row = 0; row < rows; ++row)
+        {
+            const double *g_row = g + row * columns;
+            #pragma omp simd
+            for (size_t column = begin; column < end; ++column)
+                column_scratch[column] += g_row[column] * g_row[column] + epsilon;
+        }
+        for (size_t column = begin; column < end; ++column)
+        {
+            column_stats[column] = beta2 * column_stats[column] + (1 - beta2) * column_scratch[column] / rows;
+            column_scratch[column] = 1 / sqrt(column_stats[column]);
+        }
+    }
+
+    // The factored estimate is v[row][column] = row_stats[row] * column_stats[column] / row_stat_mean.
+    double squared_sum = 0;
+    #pragma omp parallel for schedule(static) reduction(+:squared_sum) if(parallel)
+    for (size_t row = 0; row < rows; ++row)
+    {
+        const double *g_row = g + row * columns;
+        double row_scale = sqrt(row_stat_mean / row_stats[row]);
+        double sum = 0;
+        #pragma omp simd reduction(+:sum)
+        for (size_t column = 0; column < columns; ++column)
+        {
+            double u = g_row[column] * row_scale * column_scratch[column];
+            sum += u * u;
+        }
+        squared_sum += sum;
+    }
+
+    double rms = sqrt(squared_sum / count);
+    double step = optimizer->alpha / fmax(1, rms / optimizer->clip_threshold);
+    double decay = optimizer->alpha * optimizer->weight_decay;
+    #pragma omp parallel for schedule(static) if(parallel)
+    for (size_t row = 0; row < rows; ++row)
+    {
+        const double *g_row = g + row * columns;
+        double *param_row = params + row * columns;
+        double row_step = step * sqrt(row_stat_mean / row_stats[row]);
+        #pragma omp simd
+        for (size_t column = 0; column < columns; ++column)
+            param_row[column] -= row_step * g_row[column] * column_scratch[column] + decay * param_row[column];
+    }
+}
+
+static void adafactor_update_params(optimizer *base, neural_network *network)
+{
+    adafactor *optimizer = (adafactor*)base;
+    double beta2 = 1 - pow((double)base->t, -optimizer->decay_exponent);
+
+    double *state = base->state;
+    size_t parameter_idx = 0;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        layer *this_layer = network->layers[layer_idx];
+        size_t rows = this_layer->weight_rows, columns = this_layer->weight_columns;
+        size_t bias_count = this_layer->output_size;
+
+        double *row_stats = state;
+        double *column_stats = row_stats + rows;
+        double *bias_stats = column_stats + columns;
+        state = bias_stats + bias_count;
+
+        update_biases(optimizer, bias_count, beta2, network->parameters + parameter_idx, bias_stats, base->gradient + parameter_idx);
+        parameter_idx += bias_count;
+
+        update_weights(optimizer, rows, columns, beta2, network->parameters + parameter_idx, row_stats, column_stats, base->gradient + parameter_idx);
+        parameter_idx += rows * columns;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef ADAFACTOR_H
+#define ADAFACTOR_H
+
+#include <stddef.h>
+
+#include "optimizer.h"
+
+typedef struct neural_network neural_network;
+
+// Adafactor without momentum: the second moment of each weight matrix is factored
+// into per-row and per-column statistics, so state grows with rows + columns.
+typedef struct adafactor {
+    optimizer base;
+
+    double alpha;          // Learning rate
+    double epsilon;        // Added to squared gradients before averaging
+    double decay_exponent; // Second moment decay rate at step t is 1 - t^-decay_exponent
+    double clip_threshold; // Maximum RMS of an update, per tensor
+    double weight_decay;   // Decoupled weight decay parameter
+
+    double *column_scratch; // Per-column temporary, sized for the widest weight matrix
+} adafactor;
+
+extern const optimizer_type optimizer_adafactor;
+
+optimizer* adafactor_create(const neural_network *network, double alpha, double epsilon, double decay_exponent, double clip_threshold, double weight_decay);
+
+#endif // ADAFACTOR_H
@@ -1,126 +1,459 @@
 #include "adamw.h"
 
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "layer.h"
 #include "network.h"
-#include "batch_buffer.h"
+#include "constants.h"
 
-adamw* adamw_create(size_t size, double alpha, double beta1, double beta2, double epsilon, double weight_decay, bool amsgrad)
+// Number of parameters handed to a thread at once when a span is split.
+#define ADAMW_CHUNK_SIZE 4096
+
+// 8-bit codes are a tiny float format relative to the block scale: a nonzero code holds the
+// float exponent and the top 3 mantissa bits of |x| / scale, so 8 levels per octave,
+// covering 2^-15.875 of the block maximum for m and 2^-31.875 for v.
+#define CODE_SHIFT (23 - 3)
+#define UNIT_CODE (0x3F800000 >> CODE_SHIFT) // Code of a ratio of exactly 1
+#define SIGNED_CODE_MAX 127
+#define UNSIGNED_CODE_MAX 255
+
+static float signed_codebook[2 * SIGNED_CODE_MAX + 1]; // Indexed by code + SIGNED_CODE_MAX
+static float unsigned_codebook[UNSIGNED_CODE_MAX + 1];
+
+// Value of the code `offset` steps away from a ratio of 1.
+static float code_to_ratio(int offset)
+{
+    uint32_t bits = (uint32_t)(UNIT_CODE + offset) << CODE_SHIFT;
+    float ratio;
+    memcpy(&ratio, &bits, sizeof(ratio));
+    return ratio;
+}
+
+// Nearest code offset of a ratio in (0, 1], rounding the dropped mantissa bits.
+// The ratio must be a normal float.
+static inline int ratio_to_code(double ratio)
+{
+    float narrow = (float)ratio;
+    uint32_t bits;
+    memcpy(&bits, &narrow, sizeof(bits));
+    return (int)((bits + (UINT32_C(1) << (CODE_SHIFT - 1))) >> CODE_SHIFT) - UNIT_CODE;
+}
+
+static void init_codebooks(void)
+{
+    for (int code = -SIGNED_CODE_MAX; code <= SIGNED_CODE_MAX; ++code)
+    {
+        float magnitude = code ? code_to_ratio(abs(code) - SIGNED_CODE_MAX) : 0;
+        signed_codebook[code + SIGNED_CODE_MAX] = code < 0 ? -magnitude : magnitude;
+    }
+    for (int code = 0; code <= UNSIGNED_CODE_MAX; ++code)
+        unsigned_codebook[code] = code ? code_to_ratio(code - UNSIGNED_CODE_MAX) : 0;
+}
+
+static size_t state_element_size(adamw_state_precision precision)
 {
-    adamw *optimizer = malloc(sizeof(adamw) + 4 * size * sizeof(double));
+    switch (precision)
+    {
+    case ADAMW_STATE_FLOAT32: return sizeof(float);
+    case ADAMW_STATE_INT8: return sizeof(int8_t);
+    default: return sizeof(double);
+    }
+}
+
+static void adamw_update_params(optimizer *base, neural_network *network);
+static void adamw_free(optimizer *base);
+static void adamw_synchronize(optimizer *base, neural_network *network);
+
+const optimizer_type optimizer_adamw = {
+    .name = "AdamW",
+    .update_params = adamw_update_params,
+    .free = adamw_free,
+    .synchronize = adamw_synchronize
+};
+
+optimizer* adamw_create(size_t size, double alpha, double beta1, double beta2, double epsilon, double weight_decay, bool amsgrad, adamw_state_precision precision, const layer *sparse_layer)
+{
+    adamw *optimizer = malloc(sizeof(adamw));
     if (!optimizer) return NULL;
 
+    if (precision == ADAMW_STATE_INT8)
+        init_codebooks();
+
+    // Every vector starts on an aligned boundary; v_hat is only kept for AMSGrad.
+    size_t moment_count = amsgrad ? 3 : 2;
+    size_t block_count = (size + ADAMW_QUANTIZATION_BLOCK - 1) / ADAMW_QUANTIZATION_BLOCK;
+    size_t moment_bytes = ALIGN_SIZE(size * state_element_size(precision));
+    size_t scale_bytes = precision == ADAMW_STATE_INT8 ? ALIGN_SIZE(block_count * sizeof(float)) : 0;
+    size_t slice_count = sparse_layer ? optimizer_slice_count(sparse_layer) : 0;
+    size_t step_bytes = ALIGN_SIZE(slice_count * sizeof(uint64_t));
+
+    if (optimizer_init(&optimizer->base, &optimizer_adamw, size, moment_count * (moment_bytes + scale_bytes) + step_bytes))
+    {
+        free(optimizer);
+        return NULL;
+    }
+    double *slice_factors = NULL;
+    uint32_t *stale_slices = NULL;
+    if (sparse_layer && (optimizer_track_slices(&optimizer->base, sparse_layer)
+        || !(slice_factors = malloc(3 * slice_count * sizeof(double)))
+        || !(stale_slices = malloc(slice_count * sizeof(uint32_t)))))
+    {
+        free(slice_factors);
+        optimizer_release(&optimizer->base);
+        free(optimizer);
+        return NULL;
+    }
+
+    char *moments = optimizer->base.state;
+    char *scales = moments + moment_count * moment_bytes;
     *optimizer = (adamw) {
+        .base = optimizer->base,
         .alpha = alpha,
         .beta1 = beta1,
         .beta2 = beta2,
         .epsilon = epsilon,
         .weight_decay = weight_decay,
         .amsgrad = amsgrad,
-        .t = 0,
-        .size = size,
-        .param_delta = optimizer->data,
-        .m = optimizer->data + size,
-        .v = optimizer->data + 2 * size,
-        .v_hat = optimizer->data + 3 * size
+        .precision = precision,
+        .m = moments,
+        .v = moments + moment_bytes,
+        .v_hat = amsgrad ? moments + 2 * moment_bytes : NULL,
+        .m_scales = scale_bytes ? (float*)scales : NULL,
+        .v_scales = scale_bytes ? (float*)(scales + scale_bytes) : NULL,
+        .v_hat_scales = scale_bytes && amsgrad ? (float*)(scales + 2 * scale_bytes) : NULL,
+        .slice_steps = step_bytes ? (uint64_t*)(scales + moment_count * scale_bytes) : NULL,
+        .slice_factors = slice_factors,
+        .stale_slices = stale_slices
     };
-    memset(optimizer->data, 0, 4 * size * sizeof(double));
 
-    return optimizer;
+    return &optimizer->base;
 }
 
-void adamw_free(adamw *optimizer)
+static void adamw_free(optimizer *base)
 {
-    free(optimizer);
+    free(((adamw*)base)->slice_factors);
+    free(((adamw*)base)->stale_slices);
+    optimizer_release(base);
+    free(base);
 }
 
-static void adjust_parameter(adamw *optimizer, double *param, double *m, double *v, double *max_v_hat, double g, double weight_decay)
+// Per-step constants, hoisted out of the update kernels.
+typedef struct adamw_step {
+    double beta1, one_minus_beta1;
+    double beta2, one_minus_beta2;
+    double m_correction_bias, v_correction_bias;
+    double alpha, epsilon;
+} adamw_step;
+
+// Fused single pass over a contiguous span: moments, bias correction and decoupled weight decay.
+static inline void adamw_kernel(const adamw_step *step, size_t count, double weight_decay,
+    double *restrict params, double *restrict m, double *restrict v, const double *restrict g)
 {
-    *m = optimizer->beta1 * *m + (1 - optimizer->beta1) * g;
-    *v = optimizer->beta2 * *v + (1 - optimizer->beta2) * g * g;
+    const adamw_step s = *step;
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i)
+    {
+        double m_i = s.beta1 * m[i] + s.one_minus_beta1 * g[i];
+        double v_i = s.beta2 * v[i] + s.one_minus_beta2 * g[i] * g[i];
+        m[i] = m_i;
+        v[i] = v_i;
 
-    double m_hat = *m * optimizer->m_correction_bias;
-    double v_hat = *v * optimizer->v_correction_bias;
+        double m_hat = m_i * s.m_correction_bias;
+        double v_hat = v_i * s.v_correction_bias;
+        params[i] -= s.alpha * (m_hat / (sqrt(v_hat) + s.epsilon) + weight_decay * params[i]);
+    }
+}
 
-    *max_v_hat = optimizer->amsgrad ? fmax(*max_v_hat, v_hat) : v_hat;
+// Same as adamw_kernel, but normalizing by the running maximum of the corrected second moment.
+static inline void amsgrad_kernel(const adamw_step *step, size_t count, double weight_decay,
+    double *restrict params, double *restrict m, double *restrict v, double *restrict v_max, const double *restrict g)
+{
+    const adamw_step s = *step;
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i)
+    {
+        double m_i = s.beta1 * m[i] + s.one_minus_beta1 * g[i];
+        double v_i = s.beta2 * v[i] + s.one_minus_beta2 * g[i] * g[i];
+        m[i] = m_i;
+        v[i] = v_i;
 
-    *param -= optimizer->alpha * (m_hat / (sqrt(*max_v_hat) + optimizer->epsilon) + weight_decay * (*param));
+        double m_hat = m_i * s.m_correction_bias;
+        double v_hat = fmax(v_max[i], v_i * s.v_correction_bias);
+        v_max[i] = v_hat;
+        params[i] -= s.alpha * (m_hat / (sqrt(v_hat) + s.epsilon) + weight_decay * params[i]);
+    }
 }
 
-void adamw_update_params(adamw *optimizer, neural_network *network)
+// Updates a span of full-precision state, split in chunks across threads when large enough.
+static void adjust_span(const adamw *optimizer, const adamw_step *step, double *parameters, size_t offset, size_t count, double weight_decay)
 {
-    optimizer->t++;
-    optimizer->m_correction_bias = 1 / (1 - pow(optimizer->beta1, optimizer->t));
-    optimizer->v_correction_bias = 1 / (1 - pow(optimizer->beta2, optimizer->t));
+    double *m = (double*)optimizer->m + offset;
+    double *v = (double*)optimizer->v + offset;
+    double *v_max = optimizer->amsgrad ? (double*)optimizer->v_hat + offset : NULL;
+    const double *g = optimizer->base.gradient + offset;
+    parameters += offset;
 
-    size_t parameter_idx = 0;
-    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    size_t chunk_count = (count + ADAMW_CHUNK_SIZE - 1) / ADAMW_CHUNK_SIZE;
+    #pragma omp parallel for schedule(static) if(count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t chunk = 0; chunk < chunk_count; ++chunk)
     {
-        layer *this_layer = network->layers[layer_idx];
+        size_t begin = chunk * ADAMW_CHUNK_SIZE;
+        size_t chunk_size = count - begin < ADAMW_CHUNK_SIZE ? count - begin : ADAMW_CHUNK_SIZE;
+        if (v_max)
+            amsgrad_kernel(step, chunk_size, weight_decay, parameters + begin, m + begin, v + begin, v_max + begin, g + begin);
+        else
+            adamw_kernel(step, chunk_size, weight_decay, parameters + begin, m + begin, v + begin, g + begin);
+    }
+}
 
-        for (size_t bias_idx = 0; bias_idx < this_layer->output_size; ++bias_idx, ++parameter_idx)
+// Factors of the decay of the moments and weights of each listed slice, or of every slice
+// without a list, over the steps it skipped since its last update, up to step: with zero
+// gradients, they are geometric.
+static void skipped_decay(const adamw *optimizer, const uint32_t *list, size_t count, unsigned long step)
+{
+    double *factors = optimizer->slice_factors;
+    for (size_t slice_idx = 0; slice_idx < count; ++slice_idx)
+    {
+        size_t slice = list ? list[slice_idx] : slice_idx;
+        unsigned long skipped = step - optimizer->slice_steps[slice];
+        factors[3 * slice_idx] = skipped ? pow(optimizer->beta1, skipped) : 1;
+        factors[3 * slice_idx + 1] = skipped ? pow(optimizer->beta2, skipped) : 1;
+        factors[3 * slice_idx + 2] = skipped ? pow(1 - optimizer->alpha * optimizer->weight_decay, skipped) : 1;
+        optimizer->slice_steps[slice] = step;
+    }
+}
+
+// Applies the factors of skipped_decay and, with a step, the update to the listed slices of the
+// first layer's weights. The innermost loop walks contiguous values: across the slices for the
+// columns of a dense layer, along them for the rows of an embedding's table.
+static void decay_slices(const adamw *optimizer, const adamw_step *step, double *parameters, const uint32_t *list, size_t count)
+{
+    const struct optimizer *base = &optimizer->base;
+    double *m = optimizer->m, *v = optimizer->v, *v_max = optimizer->v_hat;
+    const double *factors = optimizer->slice_factors;
+    bool slices_inner = base->slice_stride == 1;
+    size_t outer_count = slices_inner ? base->slice_length : count;
+    size_t inner_count = slices_inner ? count : base->slice_length;
+    #pragma omp parallel for schedule(static) if(base->slice_length * count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t outer = 0; outer < outer_count; ++outer)
+    {
+        for (size_t inner = 0; inner < inner_count; ++inner)
         {
-            adjust_parameter(
-                optimizer,
-                &this_layer->biases[bias_idx],
-                &optimizer->m[parameter_idx],
-                &optimizer->v[parameter_idx],
-                &optimizer->v_hat[parameter_idx],
-                optimizer->param_delta[parameter_idx],
-                0.0
-            );
+            size_t slice_idx = slices_inner ? inner : outer, element = slices_inner ? outer : inner;
+            size_t idx = optimizer_slice_index(base, list ? list[slice_idx] : slice_idx, element);
+            m[idx] *= factors[3 * slice_idx];
+            v[idx] *= factors[3 * slice_idx + 1];
+            parameters[idx] *= factors[3 * slice_idx + 2];
+            if (!step)
+                continue;
+            if (v_max)
+                amsgrad_kernel(step, 1, optimizer->weight_decay, parameters + idx, m + idx, v + idx, v_max + idx, base->gradient + idx);
+            else
+                adamw_kernel(step, 1, optimizer->weight_decay, parameters + idx, m + idx, v + idx, base->gradient + idx);
         }
-        
-        size_t weight_count_in_layer = this_layer->input_size * this_layer->output_size;
-        for (size_t weight_idx = 0; weight_idx < weight_count_in_layer; ++weight_idx, ++parameter_idx)
+    }
+}
+
+// The first layer's weights with sparse updates: only the touched slices take the step, after
+// the decay of the ones they skipped. When the gradient touches most slices, all of them are
+// brought up to date and take the dense step.
+static void adjust_slices(const adamw *optimizer, const adamw_step *step, double *parameters)
+{
+    const struct optimizer *base = &optimizer->base;
+    size_t slice_count = base->slice_count;
+    if (base->touched_all || base->touched_count > slice_count * ADAMW_SPARSE_UPDATE_MAX_DENSITY)
+    {
+        size_t stale_count = 0;
+        for (size_t slice = 0; slice < slice_count; ++slice)
+            if (optimizer->slice_steps[slice] + 1 < base->t)
+                optimizer->stale_slices[stale_count++] = (uint32_t)slice;
+        skipped_decay(optimizer, optimizer->stale_slices, stale_count, base->t - 1);
+        decay_slices(optimizer, NULL, parameters, optimizer->stale_slices, stale_count);
+        adjust_span(optimizer, step, parameters, base->weights_offset, slice_count * base->slice_length, optimizer->weight_decay);
+        for (size_t slice = 0; slice < slice_count; ++slice)
+            optimizer->slice_steps[slice] = base->t;
+        return;
+    }
+
+    skipped_decay(optimizer, base->touched_slices, base->touched_count, base->t - 1);
+    decay_slices(optimizer, step, parameters, base->touched_slices, base->touched_count);
+    for (size_t slice_idx = 0; slice_idx < base->touched_count; ++slice_idx)
+        optimizer->slice_steps[base->touched_slices[slice_idx]] = base->t;
+}
+
+static void adamw_synchronize(optimizer *base, neural_network *network)
+{
+    adamw *optimizer = (adamw*)base;
+    if (!optimizer->slice_steps)
+        return;
+    skipped_decay(optimizer, NULL, base->slice_count, base->t);
+    decay_slices(optimizer, NULL, network->parameters, NULL, base->slice_count);
+}
+
+static void decay_span(double *restrict parameters, size_t count, double factor)
+{
+    #pragma omp parallel for simd schedule(static) if(count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i)
+        parameters[i] *= factor;
+}
+
+static void quantize_signed(const double *restrict src, size_t count, int8_t *restrict dst, float *scale)
+{
+    double absmax = 0;
+    for (size_t i = 0; i < count; ++i)
+        absmax = fmax(absmax, fabs(src[i]));
+    *scale = (float)absmax;
+
+    double inverse_scale = absmax > 0 ? 1 / (double)*scale : 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        // The floor keeps the ratio normal; anything that far below the maximum rounds to code 0.
+        int level = SIGNED_CODE_MAX + ratio_to_code(fmax(fabs(src[i]) * inverse_scale, 0x1p-40));
+        int code = level < 0 ? 0 : (level > SIGNED_CODE_MAX ? SIGNED_CODE_MAX : level);
+        dst[i] = (int8_t)(src[i] < 0 ? -code : code);
+    }
+}
+
+static void dequantize_signed(const int8_t *restrict src, size_t count, float scale, double *restrict dst)
+{
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = (double)scale * signed_codebook[src[i] + SIGNED_CODE_MAX];
+}
+
+static void quantize_unsigned(const double *restrict src, size_t count, uint8_t *restrict dst, float *scale)
+{
+    double absmax = 0;
+    for (size_t i = 0; i < count; ++i)
+        absmax = fmax(absmax, src[i]);
+    *scale = (float)absmax;
+
+    double inverse_scale = absmax > 0 ? 1 / (double)*scale : 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        // Nonzero second moments never round to 0, which would divide the update by epsilon alone.
+        int level = UNSIGNED_CODE_MAX + ratio_to_code(fmax(src[i] * inverse_scale, 0x1p-40));
+        int code = level < 1 ? 1 : (level > UNSIGNED_CODE_MAX ? UNSIGNED_CODE_MAX : level);
+        dst[i] = (uint8_t)(src[i] > 0 ? code : 0);
+    }
+}
+
+static void dequantize_unsigned(const uint8_t *restrict src, size_t count, float scale, double *restrict dst)
+{
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = (double)scale * unsigned_codebook[src[i]];
+}
+
+// Widens one block of a reduced-precision moment vector into doubles.
+static void load_block(adamw_state_precision precision, const void *moment, const float *scales, bool is_signed,
+    size_t block, size_t count, double *dst)
+{
+    size_t begin = block * ADAMW_QUANTIZATION_BLOCK;
+    if (precision == ADAMW_STATE_FLOAT32)
+    {
+        const float *src = (const float*)moment + begin;
+        for (size_t i = 0; i < count; ++i)
+            dst[i] = src[i];
+    }
+    else if (is_signed)
+        dequantize_signed((const int8_t*)moment + begin, count, scales[block], dst);
+    else
+        dequantize_unsigned((const uint8_t*)moment + begin, count, scales[block], dst);
+}
+
+// Narrows one block of doubles back into a reduced-precision moment vector.
+static void store_block(adamw_state_precision precision, void *moment, float *scales, bool is_signed,
+    size_t block, size_t count, const double *src)
+{
+    size_t begin = block * ADAMW_QUANTIZATION_BLOCK;
+    if (precision == ADAMW_STATE_FLOAT32)
+    {
+        float *dst = (float*)moment + begin;
+        for (size_t i = 0; i < count; ++i)
+            dst[i] = (float)src[i];
+    }
+    else if (is_signed)
+        quantize_signed(src, count, (int8_t*)moment + begin, &scales[block]);
+    else
+        quantize_unsigned(src, count, (uint8_t*)moment + begin, &scales[block]);
+}
+
+// Updates the whole arena one block at a time: moments are decoded into L1-resident doubles,
+// run through the same kernels and encoded back. Weight decay has already been applied.
+static void adjust_blocks(const adamw *optimizer, const adamw_step *step, double *parameters)
+{
+    adamw_state_precision precision = optimizer->precision;
+    size_t size = optimizer->base.size;
+    size_t block_count = (size + ADAMW_QUANTIZATION_BLOCK - 1) / ADAMW_QUANTIZATION_BLOCK;
+
+    #pragma omp parallel for schedule(static) if(size >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t block = 0; block < block_count; ++block)
+    {
+        size_t begin = block * ADAMW_QUANTIZATION_BLOCK;
+        size_t count = size - begin < ADAMW_QUANTIZATION_BLOCK ? size - begin : ADAMW_QUANTIZATION_BLOCK;
+        double m[ADAMW_QUANTIZATION_BLOCK], v[ADAMW_QUANTIZATION_BLOCK], v_max[ADAMW_QUANTIZATION_BLOCK];
+
+        load_block(precision, optimizer->m, optimizer->m_scales, true, block, count, m);
+        load_block(precision, optimizer->v, optimizer->v_scales, false, block, count, v);
+        if (optimizer->amsgrad)
         {
-            adjust_parameter(
-                optimizer,
-                &this_layer->weights[weight_idx],
-                &optimizer->m[parameter_idx],
-                &optimizer->v[parameter_idx],
-                &optimizer->v_hat[parameter_idx],
-                optimizer->param_delta[parameter_idx],
-                optimizer->weight_decay
-            );
+            load_block(precision, optimizer->v_hat, optimizer->v_hat_scales, false, block, count, v_max);
+            amsgrad_kernel(step, count, 0.0, parameters + begin, m, v, v_max, optimizer->base.gradient + begin);
+            store_block(precision, optimizer->v_hat, optimizer->v_hat_scales, false, block, count, v_max);
         }
+        else
+            adamw_kernel(step, count, 0.0, parameters + begin, m, v, optimizer->base.gradient + begin);
+        store_block(precision, optimizer->m, optimizer->m_scales, true, block, count, m);
+        store_block(precision, optimizer->v, optimizer->v_scales, false, block, count, v);
     }
 }
 
-void adamw_merge_batch(adamw *optimizer, batch_buffer *buffers[], size_t buffer_count)
+static void adamw_update_params(optimizer *base, neural_network *network)
 {
+    adamw *optimizer = (adamw*)base;
+    optimizer->m_correction_bias = 1 / (1 - pow(optimizer->beta1, base->t));
+    optimizer->v_correction_bias = 1 / (1 - pow(optimizer->beta2, base->t));
+
+    const adamw_step step = {
+        .beta1 = optimizer->beta1,
+        .one_minus_beta1 = 1 - optimizer->beta1,
+        .beta2 = optimizer->beta2,
+        .one_minus_beta2 = 1 - optimizer->beta2,
+        .m_correction_bias = optimizer->m_correction_bias,
+        .v_correction_bias = optimizer->v_correction_bias,
+        .alpha = optimizer->alpha,
+        .epsilon = optimizer->epsilon
+    };
+
+    // The arena and the optimizer vectors share one layout, so each layer is
+    // two linear sweeps: its biases (not decayed) then its weights.
+    bool full_precision = optimizer->precision == ADAMW_STATE_FLOAT64;
     size_t parameter_idx = 0;
-    const batch_buffer *first_buffer = buffers[0];
-    for (size_t layer_idx = 0; layer_idx < first_buffer->layer_count; ++layer_idx)
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
     {
-        const struct batch_buffer_layer_data *first_layer = first_buffer->layers[layer_idx];
+        layer *this_layer = network->layers[layer_idx];
+        size_t weight_count = this_layer->weight_rows * this_layer->weight_columns;
 
-        for (size_t bias_idx = 0; bias_idx < first_layer->output_size; ++bias_idx, ++parameter_idx)
+        if (layer_idx == 0 && optimizer->slice_steps)
         {
-            double sum = 0;
-            for (size_t buffer_idx = 0; buffer_idx < buffer_count; ++buffer_idx)
-            {
-                const struct batch_buffer_layer_data *layer_buffer = buffers[buffer_idx]->layers[layer_idx];
-                sum += layer_buffer->local_gradients[bias_idx];
-            }
-            optimizer->param_delta[parameter_idx] = sum;
+            adjust_span(optimizer, &step, network->parameters, parameter_idx, this_layer->output_size, 0.0);
+            adjust_slices(optimizer, &step, network->parameters);
         }
-
-        for (size_t neuron = 0; neuron < first_layer->output_size; ++neuron)
+        else if (full_precision)
         {
-            for (size_t input_idx = 0; input_idx < first_layer->input_size; ++input_idx, ++parameter_idx)
-            {
-                double sum = 0;
-                for (size_t buffer_idx = 0; buffer_idx < buffer_count; ++buffer_idx)
-                {
-                    const struct batch_buffer_layer_data *layer_buffer = buffers[buffer_idx]->layers[layer_idx];
-                    sum += layer_buffer->local_gradients[neuron] * layer_buffer->input[input_idx];
-                }
-                optimizer->param_delta[parameter_idx] = sum;
-            }
+            adjust_span(optimizer, &step, network->parameters, parameter_idx, this_layer->output_size, 0.0);
+            adjust_span(optimizer, &step, network->parameters, parameter_idx + this_layer->output_size, weight_count, optimizer->weight_decay);
         }
+        else
+        {
+            // Quantization blocks straddle layers, so decoupled decay gets its own pass.
+            decay_span(network->parameters + parameter_idx + this_layer->output_size, weight_count, 1 - optimizer->alpha * optimizer->weight_decay);
+        }
+        parameter_idx += this_layer->output_size + weight_count;
     }
+
+    if (!full_precision)
+        adjust_blocks(optimizer, &step, network->parameters);
 }
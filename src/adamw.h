@@ -1,13 +1,31 @@
-#ifndef OPTIMIZER_H
-#define OPTIMIZER_H
+#ifndef ADAMW_H
+#define ADAMW_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
-typedef struct neural_network neural_network;
-typedef struct batch_buffer batch_buffer;
+#include "optimizer.h"
+
+typedef struct layer layer;
+
+// Storage format of the m, v and v_hat moment vectors.
+typedef enum adamw_state_precision {
+    ADAMW_STATE_FLOAT64,
+    ADAMW_STATE_FLOAT32,
+    ADAMW_STATE_INT8     // Block-wise 8-bit minifloat codes with one float scale per block
+} adamw_state_precision;
+
+// Largest fraction of the slices of the first layer's weights (see optimizer.h) a step's
+// gradient touches for sparse updates to skip the others; past it, the step is dense.
+#define ADAMW_SPARSE_UPDATE_MAX_DENSITY 0.25
+
+// Number of parameters sharing one scale in the 8-bit state format.
+#define ADAMW_QUANTIZATION_BLOCK 256
 
 typedef struct adamw {
+    optimizer base;
+
     double alpha;        // Learning rate
     double beta1;        // Exponential decay rate for the first moment
     double beta2;        // Exponential decay rate for the second moment
@@ -15,23 +33,31 @@ typedef struct adamw {
     double weight_decay; // Weight decay parameter
     bool amsgrad;        // Flag to enable AMSGrad
 
-    unsigned long t;     // Time step counter
     double m_correction_bias;
     double v_correction_bias;
 
-    size_t size;         // Number of parameters
-    double *param_delta;
-    double *m;           // First moment vector
-    double *v;           // Second moment vector
-    double *v_hat;       // Maximum of v values for AMSGrad (if enabled)
-
-    double data[];
+    // Views into base.state, laid out like the network's parameter arena.
+    adamw_state_precision precision;
+    void *m;             // First moment vector
+    void *v;             // Second moment vector
+    void *v_hat;         // Maximum of v values for AMSGrad (if enabled)
+    float *m_scales;     // Per-block scales of m, v and v_hat (ADAMW_STATE_INT8 only)
+    float *v_scales;
+    float *v_hat_scales;
+
+    // Sparse updates: step at which each slice of the first layer's weights was last updated,
+    // in base.state. A slice the gradient of a step does not touch is skipped; its moments and
+    // weights get the decay of the skipped steps when it is next updated or synchronized. The
+    // steps its remaining momentum would have taken are dropped.
+    uint64_t *slice_steps;
+    double *slice_factors; // Scratch: three decay factors per slice
+    uint32_t *stale_slices; // Scratch: slices skipped by the previous step
 } adamw;
 
-adamw* adamw_create(size_t size, double alpha, double beta1, double beta2, double epsilon, double weight_decay, bool amsgrad);
-void adamw_free(adamw *optimizer);
+extern const optimizer_type optimizer_adamw;
 
-void adamw_update_params(adamw *optimizer, neural_network *network);
-void adamw_merge_batch(adamw *optimizer, batch_buffer *buffers[], size_t buffer_count);
+// sparse_layer, the network's first layer, turns on sparse updates of its weights; NULL for none.
+// They require ADAMW_STATE_FLOAT64.
+optimizer* adamw_create(size_t size, double alpha, double beta1, double beta2, double epsilon, double weight_decay, bool amsgrad, adamw_state_precision precision, const layer *sparse_layer);
 
-#endif /* OPTIMIZER_H */
\ No newline at end of file
+#endif // ADAMW_H
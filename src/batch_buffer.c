@@ -1,92 +1,758 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and madvise
 #include "batch_buffer.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "layer.h"
 #include "network.h"
 #include "hyperparameters.h"
+#include "constants.h"
 
-batch_buffer* batch_buffer_create(neural_network *network)
+// Arrays of one layer that the plan places in the arena. The FORWARD ones only exist for layers
+// between checkpoints, which write them during the forward pass and recompute the others later.
+enum {
+    PLANNED_ACTIVATIONS,
+    PLANNED_PREACTIVATIONS,
+    PLANNED_SIGN_MASK,
+    PLANNED_GRADIENTS,
+    PLANNED_FORWARD_ACTIVATIONS,
+    PLANNED_FORWARD_PREACTIVATIONS,
+    PLANNED_FORWARD_SIGN_MASK,
+    PLANNED_KIND_COUNT
+};
+
+typedef struct planned_array {
+    size_t sample_stride;          // Bytes per sample, 0 when all samples share one copy
+    size_t bytes;                  // Zero for arrays the layer does not need
+    size_t first_step, last_step;  // Inclusive lifetime over a training step
+    size_t offset;
+} planned_array;
+
+// Layers whose activations are kept from the forward pass: every checkpoint_every-th one and
+// the output layer. With checkpoint_every of 0 or 1, all of them.
+static bool is_checkpoint(size_t layer_idx, size_t layer_count, size_t checkpoint_every)
+{
+    return checkpoint_every <= 1 || (layer_idx + 1) % checkpoint_every == 0 || layer_idx + 1 == layer_count;
+}
+
+// The checkpoint closing the segment of layer_idx; the segment starts after the previous one.
+static size_t segment_end(size_t layer_idx, size_t layer_count, size_t checkpoint_every)
+{
+    if (checkpoint_every <= 1)
+        return layer_idx;
+    size_t end = layer_idx / checkpoint_every * checkpoint_every + checkpoint_every - 1;
+    return end < layer_count ? end : layer_count - 1;
+}
+
+// Lifetimes are in steps of a training step over L layers. The forward pass is steps 0 to L - 1,
+// but it runs sample by sample: an array written during it (the output gradient included) is
+// live from step 0, or a later sample could overwrite it. Only the scratch arrays, used by one
+// sample at a time, have shorter lives. Backpropagation then runs layer by layer over the whole
+// minibatch: the local gradients of layer l are computed, and merged, at step 2L - 1 - l and
+// last read at step 2L - l to compute those of layer l - 1. The layers of a segment between
+// checkpoints are recomputed when backpropagation reaches the checkpoint closing it.
+static void plan_layer(planned_array arrays[PLANNED_KIND_COUNT], const layer *layer, size_t layer_idx, size_t layer_count, size_t sample_count, size_t checkpoint_every)
 {
-    batch_buffer *buffer = malloc(sizeof(batch_buffer) + network->layer_count * sizeof(struct batch_buffer_layer_data*));
-    if (!buffer) return NULL;
+    // Every sample's row starts on its own cache line.
+    size_t width = ALIGN_SIZE(layer->output_size * sizeof(double));
+    size_t mask_width = ALIGN_SIZE((layer->output_size + SIGN_MASK_WORD_BITS - 1) / SIGN_MASK_WORD_BITS * sizeof(uint64_t));
+    size_t backward_step = 2 * layer_count - 1 - layer_idx;
+    bool kept = is_checkpoint(layer_idx, layer_count, checkpoint_every);
+    size_t produced_step = kept ? 0 : 2 * layer_count - 1 - segment_end(layer_idx, layer_count, checkpoint_every);
+    size_t scratch_step = kept ? layer_idx : produced_step;
+    activation_storage storage = layer->activation_pair.storage;
+
+    // The activations are read by the next layer, by its weight gradients and by this layer's derivative.
+    arrays[PLANNED_ACTIVATIONS] = (planned_array) {width, width * sample_count, produced_step, backward_step, 0};
+
+    // Identity layers keep their sums as their activations; other layers only keep them if their
+    // derivative reads them. Otherwise a single scratch copy serves every sample.
+    if (storage == ACTIVATION_KEEPS_PREACTIVATIONS)
+        arrays[PLANNED_PREACTIVATIONS] = arrays[PLANNED_ACTIVATIONS];
+    else if (storage == ACTIVATION_ALIASES_PREACTIVATIONS)
+        arrays[PLANNED_PREACTIVATIONS] = (planned_array) {0};
+    else
+        arrays[PLANNED_PREACTIVATIONS] = (planned_array) {0, width, scratch_step, scratch_step, 0};
+
+    if (storage == ACTIVATION_KEEPS_SIGN_MASK)
+        arrays[PLANNED_SIGN_MASK] = (planned_array) {mask_width, mask_width * sample_count, produced_step, backward_step, 0};
+    else
+        arrays[PLANNED_SIGN_MASK] = (planned_array) {0};
+
+    // The output layer's gradients come from the loss, right after each sample's forward pass.
+    size_t gradient_step = layer_idx + 1 == layer_count ? 0 : backward_step;
+    arrays[PLANNED_GRADIENTS] = (planned_array) {width, width * sample_count, gradient_step, backward_step + 1, 0};
+
+    // Between checkpoints, the forward pass only needs single scratch copies, read by the next layer.
+    arrays[PLANNED_FORWARD_ACTIVATIONS] = (planned_array) {0};
+    arrays[PLANNED_FORWARD_PREACTIVATIONS] = (planned_array) {0};
+    arrays[PLANNED_FORWARD_SIGN_MASK] = (planned_array) {0};
+    if (!kept)
+    {
+        arrays[PLANNED_FORWARD_ACTIVATIONS] = (planned_array) {0, width, layer_idx, layer_idx + 1, 0};
+        if (storage != ACTIVATION_ALIASES_PREACTIVATIONS)
+            arrays[PLANNED_FORWARD_PREACTIVATIONS] = (planned_array) {0, width, layer_idx, layer_idx, 0};
+        if (storage == ACTIVATION_KEEPS_SIGN_MASK)
+            arrays[PLANNED_FORWARD_SIGN_MASK] = (planned_array) {0, mask_width, layer_idx, layer_idx, 0};
+    }
+}
+
+static bool lifetimes_overlap(const planned_array *a, const planned_array *b)
+{
+    return a->first_step <= b->last_step && b->first_step <= a->last_step;
+}
+
+// First fit by decreasing size: each array goes at the lowest aligned offset where it overlaps no
+// array already placed whose lifetime overlaps its own. Returns the size of the arena.
+static size_t place_arrays(planned_array *arrays, size_t array_count)
+{
+    size_t *order = malloc(array_count * sizeof(size_t));
+    if (!order) return 0;
+
+    // Insertion sort: there are only a few arrays per layer.
+    for (size_t i = 0; i < array_count; ++i)
+    {
+        size_t j = i;
+        for (; j > 0 && arrays[order[j - 1]].bytes < arrays[i].bytes; --j)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
 
-    buffer->layer_count = network->layer_count;
-    for (size_t i = 0; i < network->layer_count; ++i)
+    size_t arena_size = 0;
+    for (size_t i = 0; i < array_count && arrays[order[i]].bytes > 0; ++i)
     {
-        layer *current_layer = network->layers[i];
-        size_t output_size = current_layer->output_size;
+        planned_array *array = &arrays[order[i]];
+        array->offset = 0;
+        for (bool moved = true; moved;)
+        {
+            moved = false;
+            for (size_t j = 0; j < i; ++j)
+            {
+                const planned_array *placed = &arrays[order[j]];
+                if (lifetimes_overlap(array, placed)
+                    && array->offset < placed->offset + placed->bytes
+                    && placed->offset < array->offset + array->bytes)
+                {
+                    array->offset = ALIGN_SIZE(placed->offset + placed->bytes);
+                    moved = true;
+                }
+            }
+        }
+        if (array->offset + array->bytes > arena_size)
+            arena_size = array->offset + array->bytes;
+    }
 
-        size_t data_block_size = output_size // Preactivation sums
-            + output_size // Activations
-            + output_size; // Local gradient
-        struct batch_buffer_layer_data *layer_data = malloc(sizeof(struct batch_buffer_layer_data)
-            + data_block_size * sizeof(double));
-        
-        double *preactivation_sums = layer_data->data;
-        double *activations        = preactivation_sums + output_size;
-        double *local_gradients    = activations        + output_size;
+    free(order);
+    return ALIGN_SIZE(arena_size);
+}
+
+static void *planned_pointer(void *data, const planned_array *array, size_t sample_idx)
+{
+    return array->bytes ? (char*)data + array->offset + array->sample_stride * sample_idx : NULL;
+}
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// Maps whole, aligned huge pages and asks for them to be backed by transparent huge pages.
+// Returns NULL where that is not supported, for the caller to fall back to aligned_alloc.
+static void *map_huge_pages(size_t bytes, size_t *mapped_bytes)
+{
+#ifdef MADV_HUGEPAGE
+    size_t size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    char *mapping = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    // Trim the mapping to a huge page boundary on both sides.
+    size_t head = (HUGE_PAGE_SIZE - (uintptr_t)mapping % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+    if (head)
+        munmap(mapping, head);
+    munmap(mapping + head + size, HUGE_PAGE_SIZE - head);
+
+    // Only advice: the kernel keeps small pages when transparent huge pages are disabled.
+    madvise(mapping + head, size, MADV_HUGEPAGE);
+    *mapped_bytes = size;
+    return mapping + head;
+#else
+    (void)bytes;
+    (void)mapped_bytes;
+    return NULL;
+#endif
+}
+
+// Default neurons per tile of the matrix products: small enough for a tile of every
+// per-neuron array to stay in L1 until the activation epilogue has used it.
+#define EPILOGUE_TILE_SIZE 64
+_Static_assert(EPILOGUE_TILE_SIZE % SIGN_MASK_WORD_BITS == 0, "tiles must cover whole sign mask words");
+#define MAX_BLOCK 4
+
+// A dense step of one sample: the forward pass of a layer, or the backward pass of the local
+// gradients of the next layer into it. Sizes are those of the weights.
+struct batch_op {
+    void (*kernel)(const batch_op *op);
+    void (*sums)(const batch_op *op, size_t begin, size_t end); // Variant of the dense loop over neurons [begin, end)
+    size_t tile_size;
+    const double *weights;
+    const double *biases;     // Forward steps only
+    size_t input_size, output_size;
+    size_t vocabulary_size;   // Forward steps of embeddings only
+    struct batch_buffer_layer_data *data; // The layer the step writes
+    const double *gradients;  // Backward steps only: local gradients of the next layer
+    void (*activation)(batch_buffer_layer_data *layer);
+    void (*activation_tile)(batch_buffer_layer_data *layer, size_t begin, size_t end);
+};
+
+// Where the compiler can target it, the dense loops have a variant built for the FMA instruction
+// set, selected when the arena is created on a processor that has it. Without it, each fma() is
+// a call to libm. Both variants round every multiply-add once, in the same order: they give
+// bit-identical results.
+#if defined(__GNUC__) && defined(__x86_64__)
+    #define FMA_TARGET __attribute__((target("fma")))
+    #define ALWAYS_INLINE __attribute__((always_inline))
+    #define HAS_FMA() __builtin_cpu_supports("fma")
+#else
+    #define FMA_TARGET
+    #define ALWAYS_INLINE
+    #define HAS_FMA() false
+#endif
+
+// Fields are read into locals first: the stores to the layer's arrays could alias op.
+// Each block of neurons shares the loads of the input, with one accumulation chain per neuron.
+static inline ALWAYS_INLINE void dot_products(const batch_op *op, size_t begin, size_t end, size_t block)
+{
+    const double *input = op->data->input, *weights = op->weights, *biases = op->biases;
+    double *sums = op->data->preactivation_sums;
+    size_t input_size = op->input_size;
+    size_t neuron = begin;
+    for (; neuron + block <= end; neuron += block)
+    {
+        double sum[MAX_BLOCK];
+        const double *w = weights + input_size * neuron;
+        for (size_t lane = 0; lane < block; ++lane)
+            sum[lane] = biases[neuron + lane];
+        for (size_t input_idx = 0; input_idx < input_size; ++input_idx)
+            for (size_t lane = 0; lane < block; ++lane)
+                sum[lane] = fma(w[input_size * lane + input_idx], input[input_idx], sum[lane]);
+        for (size_t lane = 0; lane < block; ++lane)
+            sums[neuron + lane] = sum[lane];
+    }
+    for (; neuron < end; ++neuron)
+    {
+        double sum = biases[neuron];
+        const double *w = weights + input_size * neuron;
+        for (size_t input_idx = 0; input_idx < input_size; ++input_idx)
+            sum = fma(w[input_idx], input[input_idx], sum);
+        sums[neuron] = sum;
+    }
+}
+
+// The same over the nonzero inputs of the first layer, gathered by gather_sparse_input: the terms
+// of the zero inputs only add zeros, so the sums are the same, up to the sign of a zero sum.
+static inline ALWAYS_INLINE void sparse_dot_products(const batch_op *op, size_t begin, size_t end, size_t block)
+{
+    const struct batch_buffer_layer_data *data = op->data;
+    size_t count = data->sparse_count;
+    if (count == SPARSE_INPUT_DENSE)
+    {
+        dot_products(op, begin, end, block);
+        return;
+    }
+    const uint32_t *indices = data->sparse_indices;
+    const double *values = data->sparse_values, *weights = op->weights, *biases = op->biases;
+    double *sums = data->preactivation_sums;
+    size_t input_size = op->input_size;
+    size_t neuron = begin;
+    for (; neuron + block <= end; neuron += block)
+    {
+        double sum[MAX_BLOCK];
+        const double *w = weights + input_size * neuron;
+        for (size_t lane = 0; lane < block; ++lane)
+            sum[lane] = biases[neuron + lane];
+        for (size_t nonzero = 0; nonzero < count; ++nonzero)
+            for (size_t lane = 0; lane < block; ++lane)
+                sum[lane] = fma(w[input_size * lane + indices[nonzero]], values[nonzero], sum[lane]);
+        for (size_t lane = 0; lane < block; ++lane)
+            sums[neuron + lane] = sum[lane];
+    }
+    for (; neuron < end; ++neuron)
+    {
+        double sum = biases[neuron];
+        const double *w = weights + input_size * neuron;
+        for (size_t nonzero = 0; nonzero < count; ++nonzero)
+            sum = fma(w[indices[nonzero]], values[nonzero], sum);
+        sums[neuron] = sum;
+    }
+}
+
+// Rows of the next layer's weights are walked contiguously over the tile, a block of rows per
+// pass; each error sum still accumulates its terms in output order, as a per-neuron dot product would.
+static inline ALWAYS_INLINE void weighted_gradients(const batch_op *op, size_t begin, size_t end, size_t block)
+{
+    const double *weights = op->weights, *gradients = op->gradients;
+    double *sums = op->data->local_gradients;
+    size_t input_size = op->input_size, output_size = op->output_size;
+    for (size_t neuron = begin; neuron < end; ++neuron)
+        sums[neuron] = 0;
+    size_t output_idx = 0;
+    for (; output_idx + block <= output_size; output_idx += block)
+    {
+        const double *w = weights + input_size * output_idx;
+        const double *d = gradients + output_idx;
+        #pragma omp simd
+        for (size_t neuron = begin; neuron < end; ++neuron)
+        {
+            double sum = sums[neuron];
+            for (size_t lane = 0; lane < block; ++lane)
+                sum = fma(d[lane], w[input_size * lane + neuron], sum);
+            sums[neuron] = sum;
+        }
+    }
+    for (; output_idx < output_size; ++output_idx)
+    {
+        const double *w = weights + input_size * output_idx;
+        double d = gradients[output_idx];
+        #pragma omp simd
+        for (size_t neuron = begin; neuron < end; ++neuron)
+            sums[neuron] = fma(d, w[neuron], sums[neuron]);
+    }
+}
+
+// Embedding layers copy the table row of each input, field by field, with the biases added.
+static void embedding_sums(const batch_op *op, size_t begin, size_t end)
+{
+    const double *input = op->data->input, *table = op->weights, *biases = op->biases;
+    double *sums = op->data->preactivation_sums;
+    size_t units = op->output_size / op->input_size;
+    for (size_t field = begin / units, neuron = begin; neuron < end; ++field)
+    {
+        size_t field_begin = field * units, field_end = field_begin + units < end ? field_begin + units : end;
+        const double *row = table + units * layer_embedding_row(op->vocabulary_size, input[field]);
+        for (; neuron < field_end; ++neuron)
+            sums[neuron] = biases[neuron] + row[neuron - field_begin];
+    }
+}
+
+// Defines the dense loops for one block size, in both instruction sets.
+#define DENSE_VARIANTS(block) \
+    static void preactivation_sums_##block(const batch_op *op, size_t begin, size_t end) \
+    { \
+        dot_products(op, begin, end, block); \
+    } \
+    FMA_TARGET static void preactivation_sums_fma_##block(const batch_op *op, size_t begin, size_t end) \
+    { \
+        dot_products(op, begin, end, block); \
+    } \
+    static void sparse_preactivation_sums_##block(const batch_op *op, size_t begin, size_t end) \
+    { \
+        sparse_dot_products(op, begin, end, block); \
+    } \
+    FMA_TARGET static void sparse_preactivation_sums_fma_##block(const batch_op *op, size_t begin, size_t end) \
+    { \
+        sparse_dot_products(op, begin, end, block); \
+    } \
+    static void error_sums_##block(const batch_op *op, size_t begin, size_t end) \
+    { \
+        weighted_gradients(op, begin, end, block); \
+    } \
+    FMA_TARGET static void error_sums_fma_##block(const batch_op *op, size_t begin, size_t end) \
+    { \
+        weighted_gradients(op, begin, end, block); \
+    }
+DENSE_VARIANTS(1)
+DENSE_VARIANTS(2)
+DENSE_VARIANTS(4)
+
+typedef void (*dense_loop)(const batch_op *op, size_t begin, size_t end);
+
+// Indexed by the use of FMA, then by the base 2 logarithm of the block size.
+static const dense_loop forward_loops[2][3] = {
+    {preactivation_sums_1, preactivation_sums_2, preactivation_sums_4},
+    {preactivation_sums_fma_1, preactivation_sums_fma_2, preactivation_sums_fma_4}
+};
+static const dense_loop sparse_forward_loops[2][3] = {
+    {sparse_preactivation_sums_1, sparse_preactivation_sums_2, sparse_preactivation_sums_4},
+    {sparse_preactivation_sums_fma_1, sparse_preactivation_sums_fma_2, sparse_preactivation_sums_fma_4}
+};
+static const dense_loop backward_loops[2][3] = {
+    {error_sums_1, error_sums_2, error_sums_4},
+    {error_sums_fma_1, error_sums_fma_2, error_sums_fma_4}
+};
+
+static dense_loop select_loop(const dense_loop loops[2][3], size_t block)
+{
+    return loops[HAS_FMA() ? 1 : 0][block >= 4 ? 2 : block >= 2 ? 1 : 0];
+}
+
+static size_t select_tile_size(size_t tile_size)
+{
+    return tile_size && tile_size % SIGN_MASK_WORD_BITS == 0 ? tile_size : EPILOGUE_TILE_SIZE;
+}
+
+static void forward_fused(const batch_op *op)
+{
+    for (size_t begin = 0; begin < op->output_size; begin += op->tile_size)
+    {
+        size_t end = begin + op->tile_size < op->output_size ? begin + op->tile_size : op->output_size;
+        op->sums(op, begin, end);
+        op->activation_tile(op->data, begin, end);
+    }
+}
+
+static void forward_whole_layer(const batch_op *op)
+{
+    op->sums(op, 0, op->output_size);
+    op->activation(op->data);
+}
+
+// Linear layers: the plan already made their activations the preactivation sums.
+static void forward_linear(const batch_op *op)
+{
+    op->sums(op, 0, op->output_size);
+}
+
+static void backward_fused(const batch_op *op)
+{
+    for (size_t begin = 0; begin < op->input_size; begin += op->tile_size)
+    {
+        size_t end = begin + op->tile_size < op->input_size ? begin + op->tile_size : op->input_size;
+        op->sums(op, begin, end);
+        op->activation_tile(op->data, begin, end);
+    }
+}
+
+static void backward_whole_layer(const batch_op *op)
+{
+    op->sums(op, 0, op->input_size);
+    op->activation(op->data);
+}
+
+static void backward_linear(const batch_op *op)
+{
+    op->sums(op, 0, op->input_size);
+}
+
+static batch_op compile_forward(const layer *layer, struct batch_buffer_layer_data *layer_data, bool approximate, bool sparse)
+{
+    const activation_pair *activation = &layer->activation_pair;
+    batch_op op = {
+        .weights = layer->weights,
+        .biases = layer->biases,
+        .input_size = layer->input_size,
+        .output_size = layer->output_size,
+        .vocabulary_size = layer->vocabulary_size,
+        .data = layer_data,
+        .sums = layer->type == LAYER_EMBEDDING ? embedding_sums
+            : select_loop(sparse ? sparse_forward_loops : forward_loops, layer->kernel.forward_block),
+        .tile_size = select_tile_size(layer->kernel.forward_tile)
+    };
+    if (approximate && activation->approximation)
+    {
+        op.kernel = forward_whole_layer;
+        op.activation = activation->approximation;
+    }
+    else if (activation->base_tile)
+    {
+        op.kernel = forward_fused;
+        op.activation_tile = activation->base_tile;
+    }
+    else if (activation->storage == ACTIVATION_ALIASES_PREACTIVATIONS)
+        op.kernel = forward_linear;
+    else
+    {
+        op.kernel = forward_whole_layer;
+        op.activation = activation->base;
+    }
+    return op;
+}
+
+static batch_op compile_backward(const layer *next_layer, const struct batch_buffer_layer_data *next_layer_data, const layer *this_layer, struct batch_buffer_layer_data *this_layer_data)
+{
+    const activation_pair *activation = &this_layer->activation_pair;
+    batch_op op = {
+        .weights = next_layer->weights,
+        .input_size = next_layer->input_size,
+        .output_size = next_layer->output_size,
+        .data = this_layer_data,
+        .gradients = next_layer_data->local_gradients,
+        .sums = select_loop(backward_loops, next_layer->kernel.backward_block),
+        .tile_size = select_tile_size(next_layer->kernel.backward_tile)
+    };
+    if (activation->derivative_tile)
+    {
+        op.kernel = backward_fused;
+        op.activation_tile = activation->derivative_tile;
+    }
+    else if (activation->storage == ACTIVATION_ALIASES_PREACTIVATIONS)
+        op.kernel = backward_linear;
+    else
+    {
+        op.kernel = backward_whole_layer;
+        op.activation = activation->derivative;
+    }
+    return op;
+}
+
+// Nonzero inputs kept per sample for the sparse kernels; none below a handful of inputs.
+static size_t sparse_capacity(size_t input_size)
+{
+    return (size_t)(input_size * SPARSE_INPUT_MAX_DENSITY);
+}
+
+// Points one sample's view of every layer into the arena, and compiles its passes. The forward
+// view differs from the backward one only between checkpoints, where it uses the forward
+// scratch arrays. sparse_row, where the sample's nonzero inputs are gathered, is NULL unless the
+// format is INPUT_FORMAT_GATHERED.
+static batch_buffer* fill_view(char *header, const neural_network *network, const planned_array *arrays, char *data, bool sparse, char *sparse_row, size_t sample_idx, bool forward)
+{
+    size_t layer_count = network->layer_count;
+    batch_buffer *buffer = (batch_buffer*)header;
+    struct batch_buffer_layer_data *layer_data = (struct batch_buffer_layer_data*)(buffer->layers + layer_count);
+    batch_op *ops = (batch_op*)(layer_data + layer_count);
+
+    buffer->layer_count = layer_count;
+    const double *input = NULL; // Set by each forward pass for the first layer
+    for (size_t layer_idx = 0; layer_idx < layer_count; ++layer_idx, ++layer_data)
+    {
+        const layer *layer = network->layers[layer_idx];
+        const planned_array *layer_arrays = arrays + layer_idx * PLANNED_KIND_COUNT;
+        bool scratch = forward && layer_arrays[PLANNED_FORWARD_ACTIVATIONS].bytes;
+        double *activations = planned_pointer(data, &layer_arrays[scratch ? PLANNED_FORWARD_ACTIVATIONS : PLANNED_ACTIVATIONS], sample_idx);
+        double *preactivation_sums = planned_pointer(data, &layer_arrays[scratch ? PLANNED_FORWARD_PREACTIVATIONS : PLANNED_PREACTIVATIONS], sample_idx);
 
         *layer_data = (struct batch_buffer_layer_data) {
-            .input_size = current_layer->input_size,
-            .output_size = current_layer->output_size,
-            .preactivation_sums = preactivation_sums,
+            .input_size = layer->input_size,
+            .output_size = layer->output_size,
+            .input = input,
+            .preactivation_sums = preactivation_sums ? preactivation_sums : activations,
             .activations = activations,
-            .local_gradients = local_gradients,
+            .local_gradients = planned_pointer(data, &layer_arrays[PLANNED_GRADIENTS], sample_idx),
+            .sign_mask = planned_pointer(data, &layer_arrays[scratch ? PLANNED_FORWARD_SIGN_MASK : PLANNED_SIGN_MASK], sample_idx),
+            .sparse_count = SPARSE_INPUT_DENSE
         };
-        
-        buffer->layers[i] = layer_data;
+        buffer->layers[layer_idx] = layer_data;
+        input = activations;
+    }
+    if (sparse_row)
+    {
+        struct batch_buffer_layer_data *first = buffer->layers[0];
+        first->gathered_indices = (uint32_t*)sparse_row;
+        first->gathered_values = (double*)(sparse_row + ALIGN_SIZE(sparse_capacity(first->input_size) * sizeof(uint32_t)));
     }
+
+    // Exact networks share one list for training and inference.
+    bool approximate = network->inference_activations == ACTIVATION_BACKEND_TABLE;
+    batch_op *forward_ops = ops, *infer_ops = approximate ? ops + layer_count : ops;
+    batch_op *backward_ops = ops + 2 * layer_count;
+    for (size_t layer_idx = 0; layer_idx < layer_count; ++layer_idx)
+    {
+        const layer *layer = network->layers[layer_idx];
+        bool sparse_layer = layer_idx == 0 && sparse;
+        forward_ops[layer_idx] = compile_forward(layer, buffer->layers[layer_idx], false, sparse_layer);
+        if (approximate)
+            infer_ops[layer_idx] = compile_forward(layer, buffer->layers[layer_idx], true, sparse_layer);
+        if (layer_idx > 0)
+            backward_ops[layer_idx] = compile_backward(layer, buffer->layers[layer_idx], network->layers[layer_idx - 1], buffer->layers[layer_idx - 1]);
+    }
+    buffer->forward_ops = forward_ops;
+    buffer->infer_ops = infer_ops;
+    buffer->backward_ops = backward_ops;
     return buffer;
 }
 
-void batch_buffer_free(batch_buffer *buffer)
+batch_arena* batch_arena_create(const neural_network *network, size_t sample_count, bool huge_pages, size_t checkpoint_every, input_format format)
+{
+    // Embeddings read ids, which have no sparse form.
+    if (network->layers[0]->type != LAYER_DENSE)
+        format = INPUT_FORMAT_DENSE;
+    bool sparse_input = format != INPUT_FORMAT_DENSE;
+    size_t layer_count = network->layer_count;
+    planned_array *arrays = malloc(layer_count * PLANNED_KIND_COUNT * sizeof(planned_array));
+    if (!arrays) return NULL;
+
+    size_t unplanned_bytes = 0;
+    size_t widest_input = 0;
+    for (size_t layer_idx = 0; layer_idx < layer_count; ++layer_idx)
+    {
+        const layer *layer = network->layers[layer_idx];
+        plan_layer(arrays + layer_idx * PLANNED_KIND_COUNT, layer, layer_idx, layer_count, sample_count, checkpoint_every);
+        unplanned_bytes += 3 * layer->output_size * sizeof(double) * sample_count;
+        widest_input = layer->input_size > widest_input ? layer->input_size : widest_input;
+    }
+    size_t planned_bytes = place_arrays(arrays, layer_count * PLANNED_KIND_COUNT);
+    if (!planned_bytes)
+    {
+        free(arrays);
+        return NULL;
+    }
+
+    // One block holds everything: the arena, the views of every sample, the reduction row, the
+    // sparse input lists, then the planned arrays, each part starting on a cache line. The lists
+    // of a sample are shared by its two views.
+    size_t view_count = checkpoint_every > 1 ? 2 * sample_count : sample_count;
+    size_t view_size = sizeof(batch_buffer) + layer_count * (sizeof(struct batch_buffer_layer_data*) + sizeof(struct batch_buffer_layer_data) + 3 * sizeof(batch_op));
+    size_t header_size = ALIGN_SIZE(sizeof(batch_arena) + view_count * (sizeof(batch_buffer*) + view_size));
+    size_t row_size = ALIGN_SIZE(widest_input * sizeof(double));
+    size_t input_size = network->layers[0]->input_size;
+    size_t capacity = format == INPUT_FORMAT_GATHERED ? sparse_capacity(input_size) : 0;
+    size_t columns_size = sparse_input ? ALIGN_SIZE(input_size * sizeof(uint32_t)) + ALIGN_SIZE(input_size) : 0;
+    size_t sparse_stride = ALIGN_SIZE(capacity * sizeof(uint32_t)) + ALIGN_SIZE(capacity * sizeof(double));
+    size_t sparse_size = columns_size + sample_count * sparse_stride;
+    size_t block_size = header_size + row_size + sparse_size + planned_bytes;
+
+    size_t mapped_bytes = 0;
+    char *block = huge_pages ? map_huge_pages(block_size, &mapped_bytes) : NULL;
+    if (!block)
+        block = aligned_alloc(MEMORY_ALIGNMENT, block_size);
+    if (!block)
+    {
+        free(arrays);
+        return NULL;
+    }
+
+    batch_arena *arena = (batch_arena*)block;
+    *arena = (batch_arena) {
+        .sample_count = sample_count,
+        .layer_count = layer_count,
+        .checkpoint_every = checkpoint_every,
+        .planned_bytes = planned_bytes,
+        .unplanned_bytes = unplanned_bytes,
+        .mapped_bytes = mapped_bytes,
+        .reduction_row = (double*)(block + header_size),
+        .sparse_columns = sparse_input ? (uint32_t*)(block + header_size + row_size) : NULL,
+        .sparse_marks = sparse_input ? (uint8_t*)(block + header_size + row_size + ALIGN_SIZE(input_size * sizeof(uint32_t))) : NULL,
+        .forward_samples = arena->samples + (view_count - sample_count)
+    };
+    if (sparse_input)
+        memset(arena->sparse_marks, 0, input_size);
+    char *sparse_rows = block + header_size + row_size + columns_size;
+    char *data = block + header_size + row_size + sparse_size;
+
+    char *views = (char*)(arena->samples + view_count);
+    for (size_t view_idx = 0; view_idx < view_count; ++view_idx)
+    {
+        size_t sample_idx = view_idx % sample_count;
+        bool forward = view_idx >= sample_count;
+        char *sparse_row = capacity ? sparse_rows + sample_idx * sparse_stride : NULL;
+        arena->samples[view_idx] = fill_view(views + view_idx * view_size, network, arrays, data, sparse_input, sparse_row, sample_idx, forward);
+    }
+
+    free(arrays);
+    return arena;
+}
+
+void batch_arena_free(batch_arena *arena)
 {
-    for (size_t layer_idx = 0; layer_idx < buffer->layer_count; ++layer_idx)
-        free(buffer->layers[layer_idx]);
-    free(buffer);
+    if (!arena) return;
+    if (arena->mapped_bytes)
+        munmap(arena, arena->mapped_bytes);
+    else
+        free(arena);
 }
 
-void batch_buffer_forward(const neural_network *network, batch_buffer *buffer, const double *input)
+// Lists the nonzero inputs of a sample with gathered lists, unless there are more than they hold.
+static void gather_sparse_input(struct batch_buffer_layer_data *layer, const double *input)
 {
-    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    if (!layer->gathered_indices)
+    {
+        layer->sparse_count = SPARSE_INPUT_DENSE;
+        return;
+    }
+    size_t capacity = sparse_capacity(layer->input_size), count = 0;
+    for (size_t input_idx = 0; input_idx < layer->input_size; ++input_idx)
     {
-        layer *layer = network->layers[layer_idx];
-        struct batch_buffer_layer_data *layer_data = buffer->layers[layer_idx];
-        layer_data->input = input;
-        for (size_t neuron = 0; neuron < layer->output_size; ++neuron)
+        if (input[input_idx] == 0)
+            continue;
+        if (count == capacity)
         {
-            double sum = layer->biases[neuron];
-            size_t offset = layer->input_size * neuron;
-            for (size_t input_idx = 0; input_idx < layer->input_size; ++input_idx)
-                sum = fma(layer->weights[offset + input_idx], input[input_idx], sum);
-            layer_data->preactivation_sums[neuron] = sum;
+            layer->sparse_count = SPARSE_INPUT_DENSE;
+            return;
         }
-        layer->activation_pair.base(layer_data);
-        input = layer_data->activations;
+        layer->gathered_indices[count] = (uint32_t)input_idx;
+        layer->gathered_values[count++] = input[input_idx];
     }
+    layer->sparse_indices = layer->gathered_indices;
+    layer->sparse_values = layer->gathered_values;
+    layer->sparse_count = count;
 }
 
-void batch_buffer_backpropagate(const neural_network *network, batch_buffer *buffer)
+// Sparse samples have no dense input for the dense kernels to fall back on.
+static void set_sparse_input(struct batch_buffer_layer_data *layer, size_t count, const uint32_t *indices, const double *values)
 {
-    for (size_t layer_idx = network->layer_count - 1; layer_idx > 0; --layer_idx)
-    {
-        layer *next_layer = network->layers[layer_idx];
-        layer *this_layer = network->layers[layer_idx - 1];
-        struct batch_buffer_layer_data *next_layer_data = buffer->layers[layer_idx];
-        struct batch_buffer_layer_data *this_layer_data = buffer->layers[layer_idx - 1];
+    layer->input = NULL;
+    layer->sparse_indices = indices;
+    layer->sparse_values = values;
+    layer->sparse_count = count;
+}
 
-        for (size_t neuron = 0; neuron < this_layer->output_size; ++neuron)
-        {
-            double error_sum = 0;
-            for (size_t output_idx = 0; output_idx < next_layer->output_size; ++output_idx)
-            {
-                double w = next_layer->weights[next_layer->input_size * output_idx + neuron];
-                double d = next_layer_data->local_gradients[output_idx];
-                error_sum = fma(d, w, error_sum);
-            }
-            this_layer_data->local_gradients[neuron] = error_sum;
-        }
-        this_layer->activation_pair.derivative(this_layer_data);
+static void run(const batch_op *ops, size_t first, size_t end)
+{
+    for (const batch_op *op = ops + first; op < ops + end; ++op)
+        op->kernel(op);
+}
+
+void batch_buffer_infer(batch_buffer *buffer, const double *input)
+{
+    buffer->layers[0]->input = input;
+    gather_sparse_input(buffer->layers[0], input);
+    run(buffer->infer_ops, 0, buffer->layer_count);
+}
+
+void batch_buffer_infer_sparse(batch_buffer *buffer, size_t count, const uint32_t *indices, const double *values)
+{
+    set_sparse_input(buffer->layers[0], count, indices, values);
+    run(buffer->infer_ops, 0, buffer->layer_count);
+}
+
+void batch_arena_infer(batch_arena *arena, size_t count, const double *const inputs[])
+{
+    // Layer by layer over the samples, so that each layer's weights are fetched once per batch.
+    for (size_t sample_idx = 0; sample_idx < count; ++sample_idx)
+    {
+        arena->samples[sample_idx]->layers[0]->input = inputs[sample_idx];
+        gather_sparse_input(arena->samples[sample_idx]->layers[0], inputs[sample_idx]);
     }
+    for (size_t layer_idx = 0; layer_idx < arena->layer_count; ++layer_idx)
+        for (size_t sample_idx = 0; sample_idx < count; ++sample_idx)
+            run(arena->samples[sample_idx]->infer_ops, layer_idx, layer_idx + 1);
+}
+
+void batch_arena_forward(batch_arena *arena, size_t sample_idx, const double *input)
+{
+    batch_buffer *buffer = arena->forward_samples[sample_idx];
+    buffer->layers[0]->input = input;
+    gather_sparse_input(buffer->layers[0], input);
+    run(buffer->forward_ops, 0, arena->layer_count);
+    // The backward view starts from the same input when the first segment is recomputed, and
+    // the optimizer reads its sparse lists.
+    const struct batch_buffer_layer_data *first = buffer->layers[0];
+    set_sparse_input(arena->samples[sample_idx]->layers[0], first->sparse_count, first->sparse_indices, first->sparse_values);
+    arena->samples[sample_idx]->layers[0]->input = input;
+}
+
+void batch_arena_forward_sparse(batch_arena *arena, size_t sample_idx, size_t count, const uint32_t *indices, const double *values)
+{
+    batch_buffer *buffer = arena->forward_samples[sample_idx];
+    set_sparse_input(buffer->layers[0], count, indices, values);
+    run(buffer->forward_ops, 0, arena->layer_count);
+    set_sparse_input(arena->samples[sample_idx]->layers[0], count, indices, values);
+}
+
+void batch_arena_recompute(batch_arena *arena, size_t layer_idx)
+{
+    size_t layer_count = arena->layer_count;
+    if (!is_checkpoint(layer_idx, layer_count, arena->checkpoint_every)
+        || layer_idx == 0 || is_checkpoint(layer_idx - 1, layer_count, arena->checkpoint_every))
+        return;
+
+    size_t first = layer_idx / arena->checkpoint_every * arena->checkpoint_every;
+    for (size_t sample_idx = 0; sample_idx < arena->sample_count; ++sample_idx)
+        run(arena->samples[sample_idx]->forward_ops, first, layer_idx);
+}
+
+void batch_buffer_backpropagate_layer(batch_buffer *buffer, size_t layer_idx)
+{
+    run(buffer->backward_ops, layer_idx, layer_idx + 1);
 }
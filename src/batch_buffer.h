@@ -2,28 +2,107 @@
 #define BATCH_BUFFER_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 typedef struct neural_network neural_network;
 typedef struct layer layer;
 
+#define SIGN_MASK_WORD_BITS 64
+
+// Views into a batch_arena; which arrays exist, and which share memory, is decided by its plan
+// from the layer's activation_storage.
 struct batch_buffer_layer_data {
     size_t input_size, output_size;
     const double *input;
-    double *preactivation_sums;
+    double *preactivation_sums; // Scratch shared by all samples unless the activation keeps them
     double *activations;
-    double *local_gradients;
-    double data[];
+    double *local_gradients;    // Reused by every other layer: valid until layer - 2 is backpropagated
+    uint64_t *sign_mask;        // ACTIVATION_KEEPS_SIGN_MASK only
+
+    // First layer of arenas with sparse kernels: the nonzero inputs of the sample in increasing
+    // index order, either given as such or gathered from the input into the arena's lists when
+    // there are few enough. sparse_count is SPARSE_INPUT_DENSE otherwise, and the dense kernels run.
+    const uint32_t *sparse_indices;
+    const double *sparse_values;
+    size_t sparse_count;
+    uint32_t *gathered_indices;
+    double *gathered_values;
 };
 
+#define SPARSE_INPUT_DENSE SIZE_MAX
+// Largest fraction of nonzero inputs for which the sparse kernels run. On a 784-256-64-4 network,
+// they still train faster at 74% nonzero inputs; half leaves a margin for tuned dense kernels.
+#define SPARSE_INPUT_MAX_DENSITY 0.5
+
+static inline bool sign_mask_get(const uint64_t *sign_mask, size_t neuron)
+{
+    return (sign_mask[neuron / SIGN_MASK_WORD_BITS] >> (neuron % SIGN_MASK_WORD_BITS)) & 1;
+}
+
+// A pass over one sample, compiled when the arena is created into a flat list of steps with
+// their kernel variant, parameters and arrays already resolved.
+typedef struct batch_op batch_op;
+
 typedef struct batch_buffer {
     size_t layer_count;
+    const batch_op *forward_ops;  // One per layer, with the exact activations
+    const batch_op *infer_ops;    // One per layer, with the network's inference backend
+    const batch_op *backward_ops; // Step layer_idx computes the local gradients of layer_idx - 1
     struct batch_buffer_layer_data *layers[];
 } batch_buffer;
 
-batch_buffer* batch_buffer_create(neural_network *network);
-void batch_buffer_free(batch_buffer *buffer);
+// The buffers of every sample of a minibatch, carved out of one 64-byte aligned block whose
+// layout comes from the liveness of each array over a training step: forward through the layers
+// sample by sample, then backward one layer at a time over the whole minibatch.
+// Each array of a layer holds all samples contiguously, one cache-line aligned row per sample.
+//
+// With checkpoint_every = k > 1, only every k-th layer and the output layer keep their arrays
+// from the forward pass; the layers in between are recomputed, a segment at a time, when
+// backpropagation reaches them. Each sample then has a separate forward view.
+typedef struct batch_arena {
+    size_t sample_count;
+    size_t layer_count;
+    size_t checkpoint_every;
+    size_t planned_bytes;   // Bytes of the planned arrays: peak activation memory of a training step
+    size_t unplanned_bytes; // The same with three separate arrays per layer and sample
+    size_t mapped_bytes;    // Nonzero when the block is mapped on huge pages
+    double *reduction_row;  // Scratch as wide as the widest layer input, for optimizer_merge_layer
+    uint32_t *sparse_columns; // Scratch as wide as the input with sparse kernels, else NULL
+    uint8_t *sparse_marks;    // The same, all zero between two uses
+    batch_buffer **forward_samples; // Views written by batch_arena_forward; the same as samples without checkpoints
+    batch_buffer *samples[];        // Views for the loss, backpropagation and the optimizer
+} batch_arena;
+
+// How the samples reach a dense first layer. Sparse kernels run on the samples with mostly zero
+// inputs, with the same results as the dense ones.
+typedef enum input_format {
+    INPUT_FORMAT_DENSE,    // Dense kernels only
+    INPUT_FORMAT_GATHERED, // Dense inputs, whose nonzeros are gathered into lists of the arena
+    INPUT_FORMAT_SPARSE    // Nonzero lists given by the caller; dense inputs run the dense kernels
+} input_format;
+
+// The arena holds the network's parameter pointers: it must not outlive them.
+// huge_pages asks for the block to be mapped on transparent huge pages where the system supports it.
+batch_arena* batch_arena_create(const neural_network *network, size_t sample_count, bool huge_pages, size_t checkpoint_every, input_format format);
+void batch_arena_free(batch_arena *arena);
+
+// Forward pass of one sample for training.
+void batch_arena_forward(batch_arena *arena, size_t sample_idx, const double *input);
+// The same from the count nonzero inputs of the sample, in increasing index order, which must
+// stay valid until the sample is merged. The arena must have sparse kernels.
+void batch_arena_forward_sparse(batch_arena *arena, size_t sample_idx, size_t count, const uint32_t *indices, const double *values);
+// Recomputes, for every sample, the layers between the previous checkpoint and layer_idx if it
+// is a checkpoint; to be called before layer_idx is merged into the batch gradient.
+void batch_arena_recompute(batch_arena *arena, size_t layer_idx);
 
-void batch_buffer_forward(const neural_network *network, batch_buffer *buffer, const double *input);
-void batch_buffer_backpropagate(const neural_network *network, batch_buffer *buffer);
+// Forward pass evaluating activations with the network's inference backend; leaves nothing to backpropagate.
+void batch_buffer_infer(batch_buffer *buffer, const double *input);
+// The same from the nonzero inputs of the sample, as for batch_arena_forward_sparse.
+void batch_buffer_infer_sparse(batch_buffer *buffer, size_t count, const uint32_t *indices, const double *values);
+// The same for the first count samples of the arena, with the same results.
+void batch_arena_infer(batch_arena *arena, size_t count, const double *const inputs[]);
+// Computes the local gradients of layer_idx - 1 from those of layer_idx.
+void batch_buffer_backpropagate_layer(batch_buffer *buffer, size_t layer_idx);
 
-#endif // BATCH_BUFFER_H
\ No newline at end of file
+#endif // BATCH_BUFFER_H
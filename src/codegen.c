@@ -0,0 +1,296 @@
+#include "codegen.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "layer.h"
+#include "activation.h"
+#include "constants.h"
+
+// Expression of each per-neuron activation of x, NULL for softmax which needs the whole layer.
+static const struct {
+    const activation_pair *pair;
+    const char *expression;
+} activations[] = {
+    { &activation_linear, "x" },
+    { &activation_sigmoid, "1 / (1 + exp(-x))" },
+    { &activation_tanh, "tanh(x)" },
+    { &activation_relu, "0 < x ? x : 0" },
+    { &activation_leaky_relu, "(0 < x ? @P_LEAKY_RELU_LEAK : 0) * x" },
+    { &activation_swish, "x / (1 + exp(-x))" },
+    { &activation_softmax, NULL }
+};
+
+static int find_activation(const activation_pair *pair)
+{
+    for (size_t idx = 0; idx < sizeof(activations) / sizeof(*activations); ++idx)
+        if (activations[idx].pair->base == pair->base)
+            return idx;
+    return -1;
+}
+
+static void write_array(FILE *output, const double *values, size_t count, size_t stride)
+{
+    for (size_t idx = 0; idx < count; ++idx)
+        fprintf(output, idx % 4 == 0 ? "\n        %a," : " %a,", values[idx * stride]);
+    fputc('\n', output);
+}
+
+// Weights are written transposed, one row per input, so that the generated layers
+// accumulate into all their neurons at once instead of reducing one dot product per neuron.
+static void write_parameters(FILE *output, const neural_network *network, const char *prefix)
+{
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        const layer *layer = network->layers[layer_idx];
+        fprintf(output, "static _Alignas(64) const double %s_biases%zu[%zu] = {", prefix, layer_idx, layer->output_size);
+        write_array(output, layer->biases, layer->output_size, 1);
+        fprintf(output, "};\n\n");
+        if (layer->type == LAYER_EMBEDDING)
+        {
+            // Tables are already one row per id.
+            fprintf(output, "static _Alignas(64) const double %s_table%zu[%zu][%zu] = {\n", prefix, layer_idx, layer->weight_rows, layer->weight_columns);
+            for (size_t row = 0; row < layer->weight_rows; ++row)
+            {
+                fprintf(output, "    {");
+                write_array(output, layer->weights + row * layer->weight_columns, layer->weight_columns, 1);
+                fprintf(output, "    },\n");
+            }
+            fprintf(output, "};\n\n");
+            continue;
+        }
+        fprintf(output, "static _Alignas(64) const double %s_weights%zu[%zu][%zu] = {\n", prefix, layer_idx, layer->input_size, layer->output_size);
+        for (size_t input_idx = 0; input_idx < layer->input_size; ++input_idx)
+        {
+            fprintf(output, "    {");
+            write_array(output, layer->weights + input_idx, layer->output_size, layer->input_size);
+            fprintf(output, "    },\n");
+        }
+        fprintf(output, "};\n\n");
+    }
+}
+
+// Writes text with @p replaced by the prefix and @P by its uppercase version.
+static void write_template(FILE *output, const char *text, const char *prefix, const char *upper_prefix)
+{
+    for (; *text; ++text)
+    {
+        if (text[0] == '@' && (text[1] == 'p' || text[1] == 'P'))
+            fputs(*++text == 'p' ? prefix : upper_prefix, output);
+        else
+            fputc(*text, output);
+    }
+}
+
+static void write_layer(FILE *output, const neural_network *network, const char *prefix, const char *upper_prefix, size_t layer_idx, int activation_idx)
+{
+    const layer *layer = network->layers[layer_idx];
+    char input[32], result[32];
+    if (layer_idx == 0)
+        strcpy(input, "input");
+    else
+        sprintf(input, "a%zu", layer_idx - 1);
+    sprintf(result, "a%zu", layer_idx);
+
+    fprintf(output, "    // Layer %zu: %zu -> %zu, %s%s\n", layer_idx, layer->input_size, layer->output_size,
+        layer->type == LAYER_EMBEDDING ? "embedding, " : "", activation_name(&layer->activation_pair));
+    fprintf(output, "    memcpy(%s, %s_biases%zu, sizeof(%s));\n", result, prefix, layer_idx, result);
+    if (layer->type == LAYER_EMBEDDING)
+    {
+        // Same id mapping as layer_embedding_row.
+        fprintf(output, "    for (int i = 0; i < %zu; ++i)\n", layer->input_size);
+        fprintf(output, "    {\n");
+        fprintf(output, "        double value = %s[i];\n", input);
+        fprintf(output, "        size_t id = value >= 0 && value < %zu && value == (double)(size_t)value ? (size_t)value : %zu;\n", layer->vocabulary_size, layer->vocabulary_size);
+        fprintf(output, "        for (int unit = 0; unit < %zu; ++unit)\n", layer->weight_columns);
+        fprintf(output, "            %s[%zu * i + unit] += %s_table%zu[id][unit];\n", result, layer->weight_columns, prefix, layer_idx);
+        fprintf(output, "    }\n");
+    }
+    else
+    {
+        fprintf(output, "    for (int i = 0; i < %zu; ++i)\n", layer->input_size);
+        fprintf(output, "        for (int neuron = 0; neuron < %zu; ++neuron)\n", layer->output_size);
+        fprintf(output, "            %s[neuron] += %s_weights%zu[i][neuron] * %s[i];\n", result, prefix, layer_idx, input);
+    }
+    if (activations[activation_idx].expression && strcmp(activations[activation_idx].expression, "x"))
+    {
+        fprintf(output, "    for (int neuron = 0; neuron < %zu; ++neuron)\n", layer->output_size);
+        fprintf(output, "    {\n");
+        fprintf(output, "        double x = %s[neuron];\n", result);
+        fprintf(output, "        %s[neuron] = ", result);
+        write_template(output, activations[activation_idx].expression, prefix, upper_prefix);
+        fputs(";\n", output);
+        fprintf(output, "    }\n");
+    }
+    if (!activations[activation_idx].expression)
+    {
+        fprintf(output, "    {\n");
+        fprintf(output, "        double max = %s[0], sum = 0;\n", result);
+        fprintf(output, "        for (int neuron = 1; neuron < %zu; ++neuron)\n", layer->output_size);
+        fprintf(output, "            max = fmax(max, %s[neuron]);\n", result);
+        fprintf(output, "        for (int neuron = 0; neuron < %zu; ++neuron)\n", layer->output_size);
+        fprintf(output, "            sum += %s[neuron] = exp(%s[neuron] - max);\n", result, result);
+        fprintf(output, "        double inverse_sum = 1 / sum;\n");
+        fprintf(output, "        for (int neuron = 0; neuron < %zu; ++neuron)\n", layer->output_size);
+        fprintf(output, "            %s[neuron] *= inverse_sum;\n", result);
+        fprintf(output, "    }\n");
+    }
+    fputc('\n', output);
+}
+
+static void write_benchmark(FILE *output, const char *prefix, const char *upper_prefix)
+{
+    write_template(output,
+        "#ifdef @P_BENCHMARK\n"
+        "// Times @p_infer against the generic inference of libnn on the same model file:\n"
+        "//   cc -Ofast -fopenmp -D@P_BENCHMARK this_file.c -I src bin/libnn.a -lm && ./a.out model.bin\n"
+        "// or make benchmark MODEL=model.bin PREFIX=@p from the repository.\n"
+        "#include <stdio.h>\n"
+        "#include <stdlib.h>\n"
+        "#include <time.h>\n"
+        "#include \"nn.h\"\n"
+        "\n"
+        "#define BENCHMARK_INPUTS 256\n"
+        "\n"
+        "static double seconds(void)\n"
+        "{\n"
+        "    struct timespec time;\n"
+        "    timespec_get(&time, TIME_UTC);\n"
+        "    return time.tv_sec + time.tv_nsec * 1e-9;\n"
+        "}\n"
+        "\n"
+        "int main(int argc, char *argv[])\n"
+        "{\n"
+        "    nn_model *model;\n"
+        "    nn_context *context;\n"
+        "    nn_status status = argc > 1 ? nn_model_load(argv[1], &model) : NN_ERROR_ARGUMENT;\n"
+        "    if (status || (status = nn_context_create(model, 1, &context)))\n"
+        "    {\n"
+        "        fprintf(stderr, \"usage: %s model.bin: %s\\n\", argv[0], nn_status_string(status));\n"
+        "        return EXIT_FAILURE;\n"
+        "    }\n"
+        "    if (nn_model_input_size(model) != @P_INPUT_SIZE || nn_model_output_size(model) != @P_OUTPUT_SIZE)\n"
+        "    {\n"
+        "        fprintf(stderr, \"%s doesn't match the generated code\\n\", argv[1]);\n"
+        "        return EXIT_FAILURE;\n"
+        "    }\n"
+        "\n"
+        "    static double inputs[BENCHMARK_INPUTS][@P_INPUT_SIZE];\n"
+        "    static double generated[@P_OUTPUT_SIZE], generic[@P_OUTPUT_SIZE];\n"
+        "    for (int row = 0; row < BENCHMARK_INPUTS; ++row)\n"
+        "        for (int i = 0; i < @P_INPUT_SIZE; ++i)\n"
+        "            inputs[row][i] = 2.0 * rand() / RAND_MAX - 1;\n"
+        "\n"
+        "    double max_difference = 0;\n"
+        "    for (int row = 0; row < BENCHMARK_INPUTS; ++row)\n"
+        "    {\n"
+        "        @p_infer(inputs[row], generated);\n"
+        "        nn_infer(context, inputs[row], generic);\n"
+        "        for (int i = 0; i < @P_OUTPUT_SIZE; ++i)\n"
+        "            max_difference = fmax(max_difference, fabs(generated[i] - generic[i]));\n"
+        "    }\n"
+        "\n"
+        "    // Rounds for nn_infer to take about a second, from the first power of two of them that\n"
+        "    // takes over 1/16 s.\n"
+        "    long rounds = 1;\n"
+        "    double elapsed = 0;\n"
+        "    for (; elapsed < 1.0 / 16; rounds *= 2)\n"
+        "    {\n"
+        "        double start = seconds();\n"
+        "        for (long round = 0; round < rounds; ++round)\n"
+        "            nn_infer(context, inputs[round % BENCHMARK_INPUTS], generic);\n"
+        "        elapsed = seconds() - start;\n"
+        "    }\n"
+        "    rounds = (long)fmax(1, rounds / 2 / elapsed);\n"
+        "\n"
+        "    double start = seconds();\n"
+        "    for (long round = 0; round < rounds; ++round)\n"
+        "        nn_infer(context, inputs[round % BENCHMARK_INPUTS], generic);\n"
+        "    double generic_seconds = seconds() - start;\n"
+        "\n"
+        "    start = seconds();\n"
+        "    for (long round = 0; round < rounds; ++round)\n"
+        "        @p_infer(inputs[round % BENCHMARK_INPUTS], generated);\n"
+        "    double generated_seconds = seconds() - start;\n"
+        "\n"
+        "    printf(\"nn_infer: %.1f ns per inference\\n\", generic_seconds / rounds * 1e9);\n"
+        "    printf(\"@p_infer: %.1f ns per inference (%.2fx)\\n\", generated_seconds / rounds * 1e9, generic_seconds / generated_seconds);\n"
+        "    printf(\"Largest output difference: %g\\n\", max_difference);\n"
+        "\n"
+        "    nn_context_free(context);\n"
+        "    nn_model_free(model);\n"
+        "    return 0;\n"
+        "}\n"
+        "#endif // @P_BENCHMARK\n",
+        prefix, upper_prefix);
+}
+
+int codegen_write(const neural_network *network, const char *prefix, FILE *output)
+{
+    // The prefix starts every generated name, so it must be a C identifier.
+    bool identifier = isalpha((unsigned char)prefix[0]) || prefix[0] == '_';
+    for (const char *c = prefix; *c && identifier; ++c)
+        identifier = isalnum((unsigned char)*c) || *c == '_';
+    if (!identifier)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: prefix '%s' is not a C identifier\n", prefix);
+        return true;
+    }
+
+    int *activation_ids = malloc(network->layer_count * sizeof(int));
+    char *upper_prefix = malloc(strlen(prefix) + 1);
+    if (!activation_ids || !upper_prefix)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: out of memory\n");
+        free(activation_ids);
+        free(upper_prefix);
+        return true;
+    }
+    for (size_t idx = 0; idx <= strlen(prefix); ++idx)
+        upper_prefix[idx] = toupper((unsigned char)prefix[idx]);
+
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        activation_ids[layer_idx] = find_activation(&network->layers[layer_idx]->activation_pair);
+        if (activation_ids[layer_idx] < 0)
+        {
+            fprintf(stderr, PROGRAM_NAME": error: layer %zu has an activation the generator doesn't know\n", layer_idx);
+            free(activation_ids);
+            free(upper_prefix);
+            return true;
+        }
+    }
+
+    const layer *output_layer = network->layers[network->layer_count - 1];
+    fprintf(output, "// Generated by `"PROGRAM_NAME" codegen`: inference of a %zu", network->input_size);
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+        fprintf(output, "-%zu", network->layers[layer_idx]->output_size);
+    fprintf(output, " network. Do not edit.\n\n");
+    fprintf(output, "#include <math.h>\n#include <string.h>\n\n");
+    fprintf(output, "#define %s_INPUT_SIZE %zu\n", upper_prefix, network->input_size);
+    fprintf(output, "#define %s_OUTPUT_SIZE %zu\n", upper_prefix, output_layer->output_size);
+    fprintf(output, "#define %s_LEAKY_RELU_LEAK %a\n\n", upper_prefix, LEAKY_RELU_LEAK);
+
+    write_parameters(output, network, prefix);
+
+    fprintf(output, "void %s_infer(const double input[restrict %s_INPUT_SIZE], double output[restrict %s_OUTPUT_SIZE])\n{\n",
+        prefix, upper_prefix, upper_prefix);
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+        fprintf(output, "    _Alignas(64) double a%zu[%zu];\n", layer_idx, network->layers[layer_idx]->output_size);
+    fputc('\n', output);
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+        write_layer(output, network, prefix, upper_prefix, layer_idx, activation_ids[layer_idx]);
+    fprintf(output, "    memcpy(output, a%zu, sizeof(a%zu));\n}\n\n", network->layer_count - 1, network->layer_count - 1);
+
+    write_benchmark(output, prefix, upper_prefix);
+
+    free(activation_ids);
+    free(upper_prefix);
+    if (ferror(output))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to write the generated code\n");
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,22 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include <stdio.h>
+
+#include "network.h"
+
+// Writes a standalone C file computing the network's inference, for a model that no longer
+// changes: every layer size is a compile-time constant, the parameters are aligned static
+// const arrays written exactly (as hexadecimal floats) and the activations are inlined.
+// The generated file defines
+//   void <prefix>_infer(const double input[<PREFIX>_INPUT_SIZE], double output[<PREFIX>_OUTPUT_SIZE]);
+// and, when compiled with -D<PREFIX>_BENCHMARK and linked with libnn, a main timing it
+// against nn_infer on the same model file. prefix must be a C identifier; its uppercase
+// version starts every macro of the file.
+//
+// The activations call libm's exp and tanh rather than the kernels of fast_math.h, so
+// outputs may differ from network_infer by a few ULP; table activations are not used.
+// Returns true on failure, after printing the reason.
+int codegen_write(const neural_network *network, const char *prefix, FILE *output);
+
+#endif // CODEGEN_H
@@ -3,4 +3,8 @@
 
 #define PROGRAM_NAME "network"
 
+// Alignment of large numeric buffers (one cache line, widest SIMD register).
+#define MEMORY_ALIGNMENT 64
+#define ALIGN_SIZE(bytes) (((bytes) + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT)
+
 #endif // CONSTANTS_H
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <ctype.h>
 
 #include "constants.h"
 
@@ -26,8 +27,19 @@ void dataset_split(const dataset *ds, dataset *training_ds, dataset *validation_
         .entry_size = ds->entry_size,
         .input_size = ds->input_size,
         .output_size = ds->output_size,
-        .data = ds->data + training_ds->entry_count * ds->entry_size
+        .data = ds->data ? ds->data + training_ds->entry_count * ds->entry_size : NULL
     };
+
+    // The row offsets of the validation entries still index the shared lists.
+    if (!ds->data)
+    {
+        training_ds->row_offsets = ds->row_offsets;
+        training_ds->indices = validation_ds->indices = ds->indices;
+        training_ds->values = validation_ds->values = ds->values;
+        training_ds->outputs = ds->outputs;
+        validation_ds->row_offsets = ds->row_offsets + training_ds->entry_count;
+        validation_ds->outputs = ds->outputs + training_ds->entry_count * ds->output_size;
+    }
 }
 
 int dataset_load_csv(const char *filename, dataset *ds)
@@ -136,3 +148,160 @@ int dataset_load_csv(const char *filename, dataset *ds)
 
     return false;
 }
+
+// Doubles the capacity of a growing array until it has room past count elements.
+static int reserve(void **array, size_t *capacity, size_t count, size_t element_size)
+{
+    if (count < *capacity)
+        return false;
+    size_t new_capacity = *capacity ? *capacity : 1024;
+    while (new_capacity <= count)
+        new_capacity *= 2;
+    void *new_array = realloc(*array, new_capacity * element_size);
+    if (!new_array)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: out of memory\n");
+        return true;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return false;
+}
+
+typedef struct list_capacities {
+    size_t rows, indices, values, outputs;
+} list_capacities;
+
+// strtod, except for nan and inf, whose checks the -Ofast build would optimize away: the number
+// must start with a digit or a point, after an optional sign. end is set to text on failure.
+static double parse_finite(const char *text, char **end)
+{
+    const char *digits = text + (*text == '-' || *text == '+');
+    if (!isdigit((unsigned char)*digits) && *digits != '.')
+    {
+        *end = (char*)text;
+        return 0;
+    }
+    return strtod(text, end);
+}
+
+// Parses one entry into the lists; returns true on failure, after printing the reason.
+static int parse_libsvm_line(char *line, size_t line_idx, const char *filename, dataset *ds, list_capacities *capacities)
+{
+    char *end;
+    double label = parse_finite(line, &end);
+    if (end == line)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: missing or non-numeric label on line %zu of '%s'\n", line_idx, filename);
+        return true;
+    }
+
+    if (reserve((void**)&ds->outputs, &capacities->outputs, ds->entry_count * ds->output_size + ds->output_size - 1, sizeof(double)))
+        return true;
+    double *outputs = ds->outputs + ds->entry_count * ds->output_size;
+    if (ds->output_size == 1)
+        outputs[0] = label == -1 ? 0 : label;
+    else
+    {
+        if (!(label >= 0 && label < ds->output_size) || label != (size_t)label)
+        {
+            fprintf(stderr, PROGRAM_NAME": error: label %g on line %zu of '%s' is not a class below %zu\n", label, line_idx, filename, ds->output_size);
+            return true;
+        }
+        for (size_t output_idx = 0; output_idx < ds->output_size; ++output_idx)
+            outputs[output_idx] = output_idx == (size_t)label ? 1 : 0;
+    }
+
+    // Zero values are dropped, so the order is checked against the previous index as read.
+    size_t count = ds->row_offsets[ds->entry_count];
+    unsigned long long previous_index = 0;
+    for (char *token = end; *(token += strspn(token, " \t\r\n")) != '\0';)
+    {
+        // strtoull would also take a sign, and negate the index for a minus.
+        end = token;
+        unsigned long long index = isdigit((unsigned char)*token) ? strtoull(token, &end, 10) : 0;
+        if (end == token || *end != ':')
+        {
+            fprintf(stderr, PROGRAM_NAME": error: malformed feature on line %zu of '%s'\n", line_idx, filename);
+            return true;
+        }
+        token = end + 1;
+        double value = parse_finite(token, &end);
+        if (end == token || (*end != '\0' && !strchr(" \t\r\n", *end)))
+        {
+            fprintf(stderr, PROGRAM_NAME": error: malformed value on line %zu of '%s'\n", line_idx, filename);
+            return true;
+        }
+        token = end;
+
+        if (index <= previous_index || index > ds->input_size)
+        {
+            fprintf(stderr, PROGRAM_NAME": error: feature %llu on line %zu of '%s' is not in increasing order between 1 and %zu\n", index, line_idx, filename, ds->input_size);
+            return true;
+        }
+        previous_index = index;
+        if (value == 0)
+            continue;
+        if (reserve((void**)&ds->indices, &capacities->indices, count, sizeof(uint32_t))
+            || reserve((void**)&ds->values, &capacities->values, count, sizeof(double)))
+            return true;
+        ds->indices[count] = (uint32_t)(index - 1);
+        ds->values[count++] = value;
+    }
+    ds->row_offsets[++ds->entry_count] = count;
+    return false;
+}
+
+int dataset_load_libsvm(const char *filename, dataset *ds)
+{
+    if (ds->input_size > (size_t)UINT32_MAX + 1)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: sparse datasets are limited to %zu inputs\n", (size_t)UINT32_MAX + 1);
+        return true;
+    }
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't open '%s': %s\n", filename, strerror(errno));
+        return true;
+    }
+
+    *ds = (dataset) {
+        .entry_size = ds->input_size + ds->output_size,
+        .input_size = ds->input_size,
+        .output_size = ds->output_size
+    };
+    list_capacities capacities = {0};
+    char *line = NULL;
+    size_t line_size = 0;
+    int failed = reserve((void**)&ds->row_offsets, &capacities.rows, 0, sizeof(size_t));
+    if (!failed)
+        ds->row_offsets[0] = 0;
+    for (size_t line_idx = 1; !failed && getline(&line, &line_size, file) != -1; ++line_idx)
+    {
+        if (line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        failed = reserve((void**)&ds->row_offsets, &capacities.rows, ds->entry_count + 1, sizeof(size_t))
+            || parse_libsvm_line(line, line_idx, filename, ds, &capacities);
+    }
+    free(line);
+    fclose(file);
+
+    if (!failed && ds->entry_count == 0)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: file '%s' doesn't have any entry\n", filename);
+        failed = true;
+    }
+    if (failed)
+        dataset_free(ds);
+    return failed;
+}
+
+void dataset_free(dataset *ds)
+{
+    free(ds->data);
+    free(ds->row_offsets);
+    free(ds->indices);
+    free(ds->values);
+    free(ds->outputs);
+}
@@ -2,16 +2,31 @@
 #define DATASET_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+// Dense datasets hold each entry's inputs then expected outputs, entry_size values per entry.
+// Sparse ones (LIBSVM files) have no data: the nonzero inputs of entry i, in increasing index
+// order, are indices and values [row_offsets[i], row_offsets[i + 1]), and its expected outputs
+// are the output_size values at outputs + i * output_size.
 typedef struct dataset {
     size_t entry_count;
     size_t entry_size;
     size_t input_size;
     size_t output_size;
     double *data;
+
+    size_t *row_offsets;
+    uint32_t *indices;
+    double *values;
+    double *outputs;
 } dataset;
 
 void dataset_split(const dataset *ds, dataset *training_ds, dataset *validation_ds, double split_ratio);
 int dataset_load_csv(const char *filename, dataset *ds);
+// Lines of "<label> <index>:<value> ...", indices counting from 1 and increasing. With one
+// output, the label is the expected value, -1 standing for 0 as in binary LIBSVM files; with
+// more, it is the class of a one-hot output, counting from 0. Explicit zeros are dropped.
+int dataset_load_libsvm(const char *filename, dataset *ds);
+void dataset_free(dataset *ds);
 
-#endif // DATASET_H
\ No newline at end of file
+#endif // DATASET_H
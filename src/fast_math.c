@@ -0,0 +1,179 @@
+#include "fast_math.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// The range reductions below depend on the exact evaluation order of their
+// floating point operations: the Makefile builds this file with -fno-associative-math,
+// and the kernels stay out of line so that they keep it.
+
+#define LOG2E 1.44269504088896338700
+// ln(2) split so that n * LN2_HI is exact for |n| < 2^11.
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define SQRT2 1.41421356237309504880
+#define EXP_MIN -708.0
+#define EXP_MAX 709.0
+// Adding 1.5 * 2^52 rounds to an integer that is left in the low mantissa bits.
+#define ROUND_SHIFT 0x1.8p52
+
+// Splits x into n * ln(2) + r with |r| <= ln(2) / 2 and returns expm1(r); 2^n is stored in *scale.
+// Everything stays in double and 64-bit integer lanes: SSE2 has no vector conversions
+// between 32 and 64-bit integers, nor table gathers, which would keep the loops scalar.
+static inline double scalar_exp_reduce(double x, double *scale)
+{
+    x = x < EXP_MIN ? EXP_MIN : (x > EXP_MAX ? EXP_MAX : x);
+
+    double shifted = x * LOG2E + ROUND_SHIFT;
+    double k = shifted - ROUND_SHIFT;
+    double r = (x - k * LN2_HI) - k * LN2_LO;
+
+    // The low bits of shifted hold n in two's complement; moved into the exponent field they give 2^n.
+    uint64_t bits;
+    memcpy(&bits, &shifted, sizeof(bits));
+    bits = (bits + 1023) << 52;
+    memcpy(scale, &bits, sizeof(*scale));
+
+    // Taylor series of expm1 up to r^13; the remainder is below 2^-56. Estrin's scheme
+    // rather than Horner's keeps the dependency chain short enough for the loops to pipeline.
+    double r2 = r * r, r4 = r2 * r2, r8 = r4 * r4;
+    double p01 = 1.0 + r * 0.5;
+    double p23 = 1.0 / 6.0 + r * (1.0 / 24.0);
+    double p45 = 1.0 / 120.0 + r * (1.0 / 720.0);
+    double p67 = 1.0 / 5040.0 + r * (1.0 / 40320.0);
+    double p89 = 1.0 / 362880.0 + r * (1.0 / 3628800.0);
+    double p1011 = 1.0 / 39916800.0 + r * (1.0 / 479001600.0);
+    double p12 = 1.0 / 6227020800.0;
+    double p03 = p01 + r2 * p23;
+    double p47 = p45 + r2 * p67;
+    double p811 = p89 + r2 * p1011;
+    double p = (p03 + r4 * p47) + r8 * (p811 + r4 * p12);
+
+    return p * r;
+}
+
+static inline double scalar_exp(double x)
+{
+    double scale;
+    double em1 = scalar_exp_reduce(x, &scale);
+    return scale * (1.0 + em1);
+}
+
+// exp(x) - 1, accurate near zero where exp(x) - 1 would cancel.
+static inline double scalar_expm1(double x)
+{
+    double scale;
+    double em1 = scalar_exp_reduce(x, &scale);
+    return scale * em1 + (scale - 1.0);
+}
+
+// Natural logarithm of a positive normal number.
+static inline double scalar_log(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    // The biased exponent is moved into the mantissa of 2^52 rather than converted from an
+    // integer, since SSE2 has no vector conversion from 64-bit integers.
+    uint64_t exponent_bits = (bits >> 52) | UINT64_C(0x4330000000000000);
+    double e;
+    memcpy(&e, &exponent_bits, sizeof(e));
+    e -= 0x1p52 + 1023;
+
+    uint64_t mantissa_bits = (bits & UINT64_C(0x000FFFFFFFFFFFFF)) | UINT64_C(0x3FF0000000000000);
+    double m;
+    memcpy(&m, &mantissa_bits, sizeof(m));
+
+    // Center the mantissa on 1: m in [sqrt(2)/2, sqrt(2)).
+    int high = m >= SQRT2;
+    m = high ? 0.5 * m : m;
+    e = high ? e + 1 : e;
+
+    // log(m) = 2 atanh(s) with s = (m - 1) / (m + 1), |s| <= 0.1716.
+    double s = (m - 1.0) / (m + 1.0);
+    double s2 = s * s, s4 = s2 * s2, s8 = s4 * s4;
+    double p01 = 1.0 / 3.0 + s2 * (1.0 / 5.0);
+    double p23 = 1.0 / 7.0 + s2 * (1.0 / 9.0);
+    double p45 = 1.0 / 11.0 + s2 * (1.0 / 13.0);
+    double p67 = 1.0 / 15.0 + s2 * (1.0 / 17.0);
+    double p89 = 1.0 / 19.0 + s2 * (1.0 / 21.0);
+    double p = (p01 + s4 * p23) + s8 * ((p45 + s4 * p67) + s8 * p89);
+    double log_m = 2.0 * s + 2.0 * s * s2 * p;
+
+    return (e * LN2_LO + log_m) + e * LN2_HI;
+}
+
+static inline double scalar_tanh(double x)
+{
+    // tanh(|x|) = expm1(2|x|) / (expm1(2|x|) + 2), which rounds to 1 beyond |x| = 20.
+    double a = x < 0 ? -x : x;
+    a = a > 20.0 ? 20.0 : a;
+    double t = scalar_expm1(2.0 * a);
+    double result = t / (t + 2.0);
+    return x < 0 ? -result : result;
+}
+
+static inline double scalar_sigmoid(double x)
+{
+    return 1.0 / (1.0 + scalar_exp(-x));
+}
+
+double vector_exp_shifted_sum(double *y, const double *x, double shift, size_t count)
+{
+    double sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (size_t i = 0; i < count; ++i)
+    {
+        double e = scalar_exp(x[i] - shift);
+        y[i] = e;
+        sum += e;
+    }
+    return sum;
+}
+
+void vector_tanh(double *y, const double *x, size_t count)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i)
+        y[i] = scalar_tanh(x[i]);
+}
+
+void vector_sigmoid(double *y, const double *x, size_t count)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i)
+        y[i] = scalar_sigmoid(x[i]);
+}
+
+void vector_swish(double *y, const double *x, size_t count)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i)
+        y[i] = x[i] * scalar_sigmoid(x[i]);
+}
+
+static inline double clamp(double x, double floor, double ceiling)
+{
+    return x < floor ? floor : (x > ceiling ? ceiling : x);
+}
+
+double vector_dot_log(const double *weights, const double *x, double floor, double ceiling, size_t count)
+{
+    double sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (size_t i = 0; i < count; ++i)
+        sum += weights[i] * scalar_log(clamp(x[i], floor, ceiling));
+    return sum;
+}
+
+double vector_binary_log_likelihood(const double *expected, const double *predicted, double floor, double ceiling, size_t count)
+{
+    double sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (size_t i = 0; i < count; ++i)
+    {
+        double p = clamp(predicted[i], floor, ceiling);
+        sum += expected[i] * scalar_log(p) + (1 - expected[i]) * scalar_log(1 - p);
+    }
+    return sum;
+}
@@ -6,5 +6,13 @@
 #define ADAMW_BETA_MOMENTUM 0.9
 #define ADAMW_BETA_VARIANCE 0.999
 #define ADAMW_EPSILON 1e-8
+#define SGD_MOMENTUM 0.9
+#define LION_BETA_UPDATE 0.9
+#define LION_BETA_MOMENTUM 0.99
+#define ADAFACTOR_EPSILON 1e-30
+#define ADAFACTOR_DECAY_EXPONENT 0.8
+#define ADAFACTOR_CLIP_THRESHOLD 1.0
+#define LARS_TRUST_COEFFICIENT 0.001
+#define LAMB_EPSILON 1e-6
 
 #endif // HYPERPARAMETERS_H
\ No newline at end of file
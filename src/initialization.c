@@ -5,20 +5,31 @@
 #include "layer.h"
 #include "math_utils.h"
 
-void initialization_xavier(layer *layer)
+// Weights and biases of a layer draw from two distinct counter streams.
+#define WEIGHT_STREAM(layer_idx) (2 * (uint64_t)(layer_idx))
+#define BIAS_STREAM(layer_idx) (2 * (uint64_t)(layer_idx) + 1)
+
+// An embedding row holds the weights of one one-hot input: its fan-in is 1.
+static size_t fan_in(const layer *layer)
+{
+    return layer->type == LAYER_EMBEDDING ? 1 : layer->input_size;
+}
+
+static size_t fan_out(const layer *layer)
+{
+    return layer->type == LAYER_EMBEDDING ? layer->weight_columns : layer->output_size;
+}
+
+void initialization_xavier(layer *layer, uint64_t seed, size_t layer_idx)
 {
-    double delta = sqrt(6. / (layer->input_size + layer->output_size));
-    for (size_t i = 0; i < (layer->input_size) * layer->output_size; ++i)
-        layer->weights[i] = rand_double_in_range(-delta, delta);
-    for (size_t i = 0; i < layer->output_size; ++i)
-        layer->biases[i] = rand_double_in_range(-delta, delta);
+    double delta = sqrt(6. / (fan_in(layer) + fan_out(layer)));
+    counter_fill_uniform(layer->weights, layer->weight_rows * layer->weight_columns, -delta, delta, seed, WEIGHT_STREAM(layer_idx));
+    counter_fill_uniform(layer->biases, layer->output_size, -delta, delta, seed, BIAS_STREAM(layer_idx));
 }
 
-void initialization_he(layer *layer)
+void initialization_he(layer *layer, uint64_t seed, size_t layer_idx)
 {
-    double sigma = 2. / layer->input_size;
-    for (size_t i = 0; i < (layer->input_size) * layer->output_size; ++i)
-        layer->weights[i] = sample_gaussian_distribution(0, sigma);
-    for (size_t i = 0; i < layer->output_size; ++i)
-        layer->biases[i] = sample_gaussian_distribution(0, sigma);
+    double sigma = 2. / fan_in(layer);
+    counter_fill_gaussian(layer->weights, layer->weight_rows * layer->weight_columns, 0, sigma, seed, WEIGHT_STREAM(layer_idx));
+    counter_fill_gaussian(layer->biases, layer->output_size, 0, sigma, seed, BIAS_STREAM(layer_idx));
 }
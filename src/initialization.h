@@ -1,14 +1,19 @@
 #ifndef INITIALIZATION_H
 #define INITIALIZATION_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct layer layer;
 
-typedef void (*initialization_function)(layer *layer);
+// Every parameter value only depends on (seed, layer_idx, parameter index),
+// so the result is identical whatever the number of threads.
+typedef void (*initialization_function)(layer *layer, uint64_t seed, size_t layer_idx);
 
 // Recommanded with tanh and sigmoid
-void initialization_xavier(layer *layer);
+void initialization_xavier(layer *layer, uint64_t seed, size_t layer_idx);
 
 // Recommanded with ReLU and Swish
-void initialization_he(layer *layer);
+void initialization_he(layer *layer, uint64_t seed, size_t layer_idx);
 
-#endif // INITIALIZATION_H
\ No newline at end of file
+#endif // INITIALIZATION_H
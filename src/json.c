@@ -1105,8 +1105,8 @@ static bool parse_identifier(json_parser *parser, json_value **out)
         error = json_bool_create(false, out);
     else
     {
-        free(buffer);
         report_parsing_error(parser, JSON_ERROR_UNEXPECTED_IDENTIFIER, "unknown identifier '%s'", buffer);
+        free(buffer);
         return true;
     }
     
@@ -0,0 +1,123 @@
+#include "lamb.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "layer.h"
+#include "network.h"
+#include "math_utils.h"
+
+static void lamb_update_params(optimizer *base, neural_network *network);
+static void lamb_free(optimizer *base);
+
+const optimizer_type optimizer_lamb = {
+    .name = "LAMB",
+    .update_params = lamb_update_params,
+    .free = lamb_free
+};
+
+optimizer* lamb_create(size_t size, double alpha, double beta1, double beta2, double epsilon, double weight_decay)
+{
+    lamb *optimizer = malloc(sizeof(lamb));
+    if (!optimizer) return NULL;
+
+    if (optimizer_init(&optimizer->base, &optimizer_lamb, size, 2 * size * sizeof(double)))
+    {
+        free(optimizer);
+        return NULL;
+    }
+
+    optimizer->alpha = alpha;
+    optimizer->beta1 = beta1;
+    optimizer->beta2 = beta2;
+    optimizer->epsilon = epsilon;
+    optimizer->weight_decay = weight_decay;
+    optimizer->m = optimizer->base.state;
+    optimizer->v = optimizer->m + size;
+
+    return &optimizer->base;
+}
+
+static void lamb_free(optimizer *base)
+{
+    optimizer_release(base);
+    free(base);
+}
+
+typedef struct lamb_step {
+    double beta1, one_minus_beta1;
+    double beta2, one_minus_beta2;
+    double m_correction_bias, v_correction_bias;
+    double epsilon;
+} lamb_step;
+
+// First pass: advances the moments and returns the squared norm of the update direction.
+static double lamb_moments(const lamb_step *step, size_t count, double weight_decay,
+    const double *restrict params, double *restrict m, double *restrict v, const double *restrict g)
+{
+    const lamb_step s = *step;
+    double sum = 0;
+    #pragma omp parallel for simd schedule(static) reduction(+:sum) if(count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i)
+    {
+        double m_i = s.beta1 * m[i] + s.one_minus_beta1 * g[i];
+        double v_i = s.beta2 * v[i] + s.one_minus_beta2 * g[i] * g[i];
+        m[i] = m_i;
+        v[i] = v_i;
+
+        double r = m_i * s.m_correction_bias / (sqrt(v_i * s.v_correction_bias) + s.epsilon) + weight_decay * params[i];
+        sum += r * r;
+    }
+    return sum;
+}
+
+// Second pass: recomputes the update direction from the moments and applies it.
+static void lamb_apply(const lamb_step *step, size_t count, double learning_rate, double weight_decay,
+    double *restrict params, const double *restrict m, const double *restrict v)
+{
+    const lamb_step s = *step;
+    #pragma omp parallel for simd schedule(static) if(count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i)
+    {
+        double r = m[i] * s.m_correction_bias / (sqrt(v[i] * s.v_correction_bias) + s.epsilon) + weight_decay * params[i];
+        params[i] -= learning_rate * r;
+    }
+}
+
+static void lamb_update_params(optimizer *base, neural_network *network)
+{
+    lamb *optimizer = (lamb*)base;
+    const lamb_step step = {
+        .beta1 = optimizer->beta1,
+        .one_minus_beta1 = 1 - optimizer->beta1,
+        .beta2 = optimizer->beta2,
+        .one_minus_beta2 = 1 - optimizer->beta2,
+        .m_correction_bias = 1 / (1 - pow(optimizer->beta1, base->t)),
+        .v_correction_bias = 1 / (1 - pow(optimizer->beta2, base->t)),
+        .epsilon = optimizer->epsilon
+    };
+
+    // Biases and weights of each layer get their own trust ratio; only weights are decayed.
+    size_t parameter_idx = 0;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        layer *this_layer = network->layers[layer_idx];
+        size_t tensor_sizes[2] = {this_layer->output_size, this_layer->weight_rows * this_layer->weight_columns};
+        double weight_decays[2] = {0.0, optimizer->weight_decay};
+
+        for (int tensor = 0; tensor < 2; ++tensor)
+        {
+            size_t count = tensor_sizes[tensor];
+            double *params = network->parameters + parameter_idx;
+            double *m = optimizer->m + parameter_idx;
+            double *v = optimizer->v + parameter_idx;
+
+            double update_norm = sqrt(lamb_moments(&step, count, weight_decays[tensor], params, m, v, base->gradient + parameter_idx));
+            double weight_norm = sqrt(squared_norm(params, count));
+            double trust_ratio = weight_norm > 0 && update_norm > 0 ? weight_norm / update_norm : 1;
+            lamb_apply(&step, count, optimizer->alpha * trust_ratio, weight_decays[tensor], params, m, v);
+
+            parameter_idx += count;
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef LAMB_H
+#define LAMB_H
+
+#include <stddef.h>
+
+#include "optimizer.h"
+
+// LAMB: AdamW direction rescaled per parameter tensor by the trust ratio ||w|| / ||update||,
+// for very large batch sizes.
+typedef struct lamb {
+    optimizer base;
+
+    double alpha;        // Learning rate
+    double beta1;        // Exponential decay rate for the first moment
+    double beta2;        // Exponential decay rate for the second moment
+    double epsilon;      // Small constant for numerical stability
+    double weight_decay; // Decoupled weight decay parameter (weights only)
+
+    double *m;           // Views into base.state
+    double *v;
+} lamb;
+
+extern const optimizer_type optimizer_lamb;
+
+optimizer* lamb_create(size_t size, double alpha, double beta1, double beta2, double epsilon, double weight_decay);
+
+#endif // LAMB_H
@@ -0,0 +1,90 @@
+#include "lars.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "layer.h"
+#include "network.h"
+#include "math_utils.h"
+
+static void lars_update_params(optimizer *base, neural_network *network);
+static void lars_free(optimizer *base);
+
+const optimizer_type optimizer_lars = {
+    .name = "LARS",
+    .update_params = lars_update_params,
+    .free = lars_free
+};
+
+optimizer* lars_create(size_t size, double alpha, double momentum, double trust_coefficient, double weight_decay)
+{
+    lars *optimizer = malloc(sizeof(lars));
+    if (!optimizer) return NULL;
+
+    if (optimizer_init(&optimizer->base, &optimizer_lars, size, size * sizeof(double)))
+    {
+        free(optimizer);
+        return NULL;
+    }
+
+    optimizer->alpha = alpha;
+    optimizer->momentum = momentum;
+    optimizer->trust_coefficient = trust_coefficient;
+    optimizer->weight_decay = weight_decay;
+    optimizer->velocity = optimizer->base.state;
+
+    return &optimizer->base;
+}
+
+static void lars_free(optimizer *base)
+{
+    optimizer_release(base);
+    free(base);
+}
+
+static void lars_span(const lars *optimizer, size_t count, double learning_rate, double weight_decay,
+    double *restrict params, double *restrict velocity, const double *restrict g)
+{
+    const double momentum = optimizer->momentum;
+    #pragma omp parallel for simd schedule(static) if(count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i)
+    {
+        double v_i = momentum * velocity[i] + learning_rate * (g[i] + weight_decay * params[i]);
+        velocity[i] = v_i;
+        params[i] -= v_i;
+    }
+}
+
+// Layer-wise learning rate of one parameter tensor.
+static double trust_ratio(const lars *optimizer, const double *params, const double *gradient, size_t count, double weight_decay)
+{
+    double weight_norm = sqrt(squared_norm(params, count));
+    double gradient_norm = sqrt(squared_norm(gradient, count));
+    if (weight_norm == 0 || gradient_norm == 0)
+        return 1;
+    return optimizer->trust_coefficient * weight_norm / (gradient_norm + weight_decay * weight_norm);
+}
+
+static void lars_update_params(optimizer *base, neural_network *network)
+{
+    lars *optimizer = (lars*)base;
+
+    // Biases and weights of each layer get their own trust ratio; only weights are decayed.
+    size_t parameter_idx = 0;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        layer *this_layer = network->layers[layer_idx];
+        size_t tensor_sizes[2] = {this_layer->output_size, this_layer->weight_rows * this_layer->weight_columns};
+        double weight_decays[2] = {0.0, optimizer->weight_decay};
+
+        for (int tensor = 0; tensor < 2; ++tensor)
+        {
+            double *params = network->parameters + parameter_idx;
+            const double *gradient = base->gradient + parameter_idx;
+            double learning_rate = optimizer->alpha * trust_ratio(optimizer, params, gradient, tensor_sizes[tensor], weight_decays[tensor]);
+            lars_span(optimizer, tensor_sizes[tensor], learning_rate, weight_decays[tensor], params,
+                optimizer->velocity + parameter_idx, gradient);
+            parameter_idx += tensor_sizes[tensor];
+        }
+    }
+}
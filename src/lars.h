@@ -0,0 +1,25 @@
+#ifndef LARS_H
+#define LARS_H
+
+#include <stddef.h>
+
+#include "optimizer.h"
+
+// LARS: momentum SGD where each parameter tensor is scaled by its own trust ratio
+// ||w|| / (||g|| + weight_decay * ||w||), for very large batch sizes.
+typedef struct lars {
+    optimizer base;
+
+    double alpha;             // Global learning rate
+    double momentum;          // Decay rate of the velocity
+    double trust_coefficient; // Scale of the layer-wise learning rate
+    double weight_decay;      // Weight decay parameter (weights only)
+
+    double *velocity;         // View into base.state
+} lars;
+
+extern const optimizer_type optimizer_lars;
+
+optimizer* lars_create(size_t size, double alpha, double momentum, double trust_coefficient, double weight_decay);
+
+#endif // LARS_H
@@ -1,26 +1,43 @@
 #include "layer.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 
 #include "hyperparameters.h"
 
-layer* layer_create(size_t input_size, size_t output_size, initialization_function initialization, activation_pair activation)
+size_t layer_output_size(layer_type type, size_t input_size, size_t units)
 {
-    size_t data_block_size = output_size * input_size + output_size;
-    layer *new_layer = malloc(sizeof(layer) + data_block_size * sizeof(double));
+    return type == LAYER_EMBEDDING ? input_size * units : units;
+}
+
+size_t layer_parameter_count(layer_type type, size_t input_size, size_t units, size_t vocabulary_size)
+{
+    size_t output_size = layer_output_size(type, input_size, units);
+    return output_size + (type == LAYER_EMBEDDING ? vocabulary_size + 1 : input_size) * units;
+}
+
+layer* layer_create(layer_type type, size_t input_size, size_t units, size_t vocabulary_size, initialization_function initialization, activation_pair activation, double *parameters)
+{
+    layer *new_layer = malloc(sizeof(layer));
     if (!new_layer) return NULL;
 
+    size_t output_size = layer_output_size(type, input_size, units);
+    bool embedding = type == LAYER_EMBEDDING;
     *new_layer = (layer) {
+        .type = type,
         .input_size = input_size,
         .output_size = output_size,
+        .vocabulary_size = embedding ? vocabulary_size : 0,
         .initialization_function = initialization,
         .activation_pair = activation,
-        .parameter_count = output_size * input_size + output_size,
-        .weights = new_layer->data,
-        .biases = new_layer->data + output_size * input_size
+        .parameter_count = layer_parameter_count(type, input_size, units, vocabulary_size),
+        .weight_rows = embedding ? vocabulary_size + 1 : units,
+        .weight_columns = embedding ? units : input_size,
+        .biases = parameters,
+        .weights = parameters + output_size
     };
 
     return new_layer;
@@ -7,20 +7,51 @@
 #include "initialization.h"
 #include "activation.h"
 
+// Loop structure of the dense kernels reading the layer's weights, chosen by the autotuner of
+// tuning.h. Every configuration gives the same results; zeros select the defaults.
+typedef struct kernel_config {
+    size_t forward_tile;   // Neurons per activation epilogue tile, a multiple of 64
+    size_t forward_block;  // Neurons whose dot products share each pass over the input: 1, 2 or 4
+    size_t backward_tile;  // Neurons of the previous layer per derivative epilogue tile
+    size_t backward_block; // Rows of the weights accumulated per pass over a tile: 1, 2 or 4
+} kernel_config;
+
+typedef enum layer_type {
+    LAYER_DENSE,
+    LAYER_EMBEDDING // First layer only: its inputs are ids, each looked up in a table of vocabulary_size + 1 rows
+} layer_type;
+
 typedef struct layer {
+    layer_type type;
     size_t input_size, output_size;
+    size_t vocabulary_size; // Embedding layers only
     
     initialization_function initialization_function;
     activation_pair activation_pair;
 
+    // Views into the network's parameter arena: biases, then weights. The weights are a
+    // weight_rows x weight_columns matrix: one row per neuron over the inputs for dense layers,
+    // one row of units per id for embeddings, whose output is the row of each input in turn.
     size_t parameter_count;
-    double *weights;
+    size_t weight_rows, weight_columns;
     double *biases;
+    double *weights;
 
-    double data[];
+    kernel_config kernel;
 } layer;
 
-layer* layer_create(size_t input_size, size_t output_size, initialization_function initialization, activation_pair activation);
+// Table row an embedding input reads: the row of its id, or the last one, reserved for inputs
+// that aren't ids of the vocabulary: negative, fractional, NaN or too large.
+static inline size_t layer_embedding_row(size_t vocabulary_size, double id)
+{
+    return id >= 0 && id < (double)vocabulary_size && id == (double)(size_t)id ? (size_t)id : vocabulary_size;
+}
+
+// Sizes of a layer of the given units: neurons of a dense layer, values per id of an embedding.
+size_t layer_output_size(layer_type type, size_t input_size, size_t units);
+size_t layer_parameter_count(layer_type type, size_t input_size, size_t units, size_t vocabulary_size);
+
+layer* layer_create(layer_type type, size_t input_size, size_t units, size_t vocabulary_size, initialization_function initialization, activation_pair activation, double *parameters);
 void layer_free(layer *layer);
 
 #endif // LAYER_H
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "lion.h"
+
+#include <stdlib.h>
+
+#include "layer.h"
+#include "network.h"
+
+static void lion_update_params(optimizer *base, neural_network *network);
+static void lion_free(optimizer *base);
+
+const optimizer_type optimizer_lion = {
+    .name = "Lion",
+    .update_params = lion_update_params,
+    .free = lion_free
+};
+
+optimizer* lion_create(size_t size, double alpha, double beta1, double beta2, double weight_decay)
+{
+    lion *optimizer = malloc(sizeof(lion));
+    if (!optimizer) return NULL;
+
+    if (optimizer_init(&optimizer->base, &optimizer_lion, size, size * sizeof(double)))
+    {
+        free(optimizer);
+        return NULL;
+    }
+
+    optimizer->alpha = alpha;
+    optimizer->beta1 = beta1;
+    optimizer->beta2 = beta2;
+    optimizer->weight_decay = weight_decay;
+    optimizer->m = optimizer->base.state;
+
+    return &optimizer->base;
+}
+
+static void lion_free(optimizer *base)
+{
+    optimizer_release(base);
+    free(base);
+}
+
+static void lion_span(const lion *optimizer, size_t count, double weight_decay,
+    double *restrict params, double *restrict m, const double *restrict g)
+{
+    const double alpha = optimizer->alpha;
+    const double beta1 = optimizer->beta1, one_minus_beta1 = 1 - optimizer->beta1;
+    const double beta2 = optimizer->beta2, one_minus_beta2 = 1 - optimizer->beta2;
+    #pragma omp parallel for simd schedule(static) if(count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i)
+    {
+        double c = beta1 * m[i] + one_minus_beta1 * g[i];
+        double sign = c > 0 ? 1.0 : (c < 0 ? -1.0 : 0.0);
+        params[i] -= alpha * (sign + weight_decay * params[i]);
+        m[i] = beta2 * m[i] + one_minus_beta2 * g[i];
+    }
+}
+
+static void lion_update_params(optimizer *base, neural_network *network)
+{
+    lion *optimizer = (lion*)base;
+
+    // Biases are not decayed, weights are.
+    size_t parameter_idx = 0;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        layer *this_layer = network->layers[layer_idx];
+        size_t weight_count = this_layer->weight_rows * this_layer->weight_columns;
+
+        lion_span(optimizer, this_layer->output_size, 0.0, network->parameters + parameter_idx,
+            optimizer->m + parameter_idx, base->gradient + parameter_idx);
+        parameter_idx += this_layer->output_size;
+
+        lion_span(optimizer, weight_count, optimizer->weight_decay, network->parameters + parameter_idx,
+            optimizer->m + parameter_idx, base->gradient + parameter_idx);
+        parameter_idx += weight_count;
+    }
+}
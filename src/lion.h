@@ -0,0 +1,24 @@
+#ifndef LION_H
+#define LION_H
+
+#include <stddef.h>
+
+#include "optimizer.h"
+
+// Lion (evolved sign momentum): one state vector, updates of uniform magnitude.
+typedef struct lion {
+    optimizer base;
+
+    double alpha;        // Learning rate, typically 3-10x smaller than AdamW's
+    double beta1;        // Interpolation factor used for the update direction
+    double beta2;        // Exponential decay rate for the momentum
+    double weight_decay; // Decoupled weight decay parameter
+
+    double *m;           // View into base.state
+} lion;
+
+extern const optimizer_type optimizer_lion;
+
+optimizer* lion_create(size_t size, double alpha, double beta1, double beta2, double weight_decay);
+
+#endif // LION_H
@@ -5,16 +5,11 @@
 
 #include "layer.h"
 #include "batch_buffer.h"
+#include "fast_math.h"
 
 static double binary_cross_entropy(const double predicted[], const double expected[], size_t size)
 {
-    double sum = 0;
-    for (size_t i = 0; i < size; ++i)
-    {
-        double p = fmin(fmax(DBL_MIN, predicted[i]), 1 - DBL_EPSILON);
-        sum -= expected[i] * log(p) + (1 - expected[i]) * log(1 - p);
-    }
-    return sum;
+    return -vector_binary_log_likelihood(expected, predicted, DBL_MIN, 1 - DBL_EPSILON, size);
 }
 
 static void output_gradient_bce(const layer *output_layer, batch_buffer_layer_data *output_layer_data, const double y_true[])
@@ -74,10 +69,7 @@ const loss_function loss_mse = {
 
 static double categorical_cross_entropy(const double predicted[], const double expected[], size_t size)
 {
-    double sum = 0;
-    for (size_t i = 0; i < size; ++i)
-        sum -= expected[i] * log(fmax(DBL_MIN, predicted[i]));
-    return sum;
+    return -vector_dot_log(expected, predicted, DBL_MIN, 1, size);
 }
 
 static void output_gradient_cce_softmax(const layer *output_layer, batch_buffer_layer_data *output_layer_data, const double y_true[])
@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "json.h"
 #include "network.h"
@@ -10,6 +14,15 @@
 #include "dataset.h"
 #include "loss.h"
 #include "adamw.h"
+#include "sgd.h"
+#include "lion.h"
+#include "adafactor.h"
+#include "lars.h"
+#include "lamb.h"
+#include "model_file.h"
+#include "server.h"
+#include "codegen.h"
+#include "tuning.h"
 #include "hyperparameters.h"
 #include "math_utils.h"
 #include "constants.h"
@@ -52,6 +65,39 @@ network_layout parse_json_for_layout(const json_value *json_root)
         json_number_get(buffer_value, &double_value);
         layout.layers[i].neuron_count = double_value;
 
+        // Embeddings replace a one-hot first layer: each input is an id, its row of the table the output.
+        const char *type_name = "Dense";
+        if (!json_object_get(layer_entry, "type", &buffer_value))
+            json_string_get(buffer_value, &type_name);
+        if (!strcmp(type_name, "Embedding"))
+        {
+            double vocabulary_size = 0;
+            if (!json_object_get(layer_entry, "vocabulary_size", &buffer_value))
+                json_number_get(buffer_value, &vocabulary_size);
+            if (i != 0 || layout.layer_count < 2)
+            {
+                fprintf(stderr, PROGRAM_NAME": error: an Embedding layer must be the first of several layers\n");
+                exit(EXIT_FAILURE);
+            }
+            if (!(vocabulary_size >= 1 && vocabulary_size <= UINT32_MAX && vocabulary_size == floor(vocabulary_size)))
+            {
+                fprintf(stderr, PROGRAM_NAME": error: an Embedding layer needs an integer vocabulary_size from 1 to %" PRIu32 "\n", UINT32_MAX);
+                exit(EXIT_FAILURE);
+            }
+            layout.layers[i].type = LAYER_EMBEDDING;
+            layout.layers[i].vocabulary_size = vocabulary_size;
+        }
+        else if (!strcmp(type_name, "Dense"))
+        {
+            layout.layers[i].type = LAYER_DENSE;
+            layout.layers[i].vocabulary_size = 0;
+        }
+        else
+        {
+            fprintf(stderr, PROGRAM_NAME": error: unknown layer type '%s'\n", type_name);
+            exit(EXIT_FAILURE);
+        }
+
         const char *activation_name = "Linear";
         json_object_get(layer_entry, "activation", &buffer_value);
         json_string_get(buffer_value, &activation_name);
@@ -77,10 +123,47 @@ network_layout parse_json_for_layout(const json_value *json_root)
             layout.layers[i].initialization_function = initialization_xavier;
     }
 
+    const char *backend_name = "Exact";
+    if (!json_object_get(network_entry, "inference_activations", &buffer_value))
+        json_string_get(buffer_value, &backend_name);
+    if (!strcmp(backend_name, "Table"))
+        layout.inference_activations = ACTIVATION_BACKEND_TABLE;
+    else if (!strcmp(backend_name, "Exact"))
+        layout.inference_activations = ACTIVATION_BACKEND_EXACT;
+    else
+    {
+        fprintf(stderr, PROGRAM_NAME": error: unknown inference activation backend '%s'\n", backend_name);
+        exit(EXIT_FAILURE);
+    }
+
     return layout;
 }
 
-adamw* parse_json_for_optimizer(const neural_network *network, const json_value *json_root)
+static double parse_optional_number(const json_value *object, const char *key, double default_value)
+{
+    json_value *buffer_value = NULL;
+    double value = default_value;
+    if (!json_object_get(object, key, &buffer_value))
+        json_number_get(buffer_value, &value);
+    return value;
+}
+
+// Reads an optional count of the training section, exiting unless it is a non-negative integer.
+static size_t parse_optional_count(const json_value *object, const char *key, size_t default_value)
+{
+    json_value *buffer_value = NULL;
+    double value = default_value;
+    if (json_object_get(object, key, &buffer_value) || json_number_get(buffer_value, &value))
+        return default_value;
+    if (!(value >= 0 && value <= (double)SIZE_MAX / 2 && value == floor(value)))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: %s must be a non-negative integer\n", key);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)value;
+}
+
+optimizer* parse_json_for_optimizer(const neural_network *network, const json_value *json_root)
 {
     json_value *training_entry = NULL;
     json_object_get(json_root, "training", &training_entry);
@@ -88,34 +171,108 @@ adamw* parse_json_for_optimizer(const neural_network *network, const json_value
     json_value *optimizer_entry = NULL, *buffer_value = NULL;
     json_object_get(training_entry, "optimizer", &optimizer_entry);
 
-    double learning_rate = LEARNING_RATE;
-    if (!json_object_get(optimizer_entry, "learning_rate", &buffer_value))
-        json_number_get(buffer_value, &learning_rate);
+    const char *optimizer_name = "AdamW";
+    if (!json_object_get(optimizer_entry, "type", &buffer_value))
+        json_string_get(buffer_value, &optimizer_name);
 
-    double beta1 = ADAMW_BETA_MOMENTUM;
-    if (!json_object_get(optimizer_entry, "beta1", &buffer_value))
-        json_number_get(buffer_value, &beta1);
+    double learning_rate = parse_optional_number(optimizer_entry, "learning_rate", LEARNING_RATE);
+    double weight_decay = parse_optional_number(optimizer_entry, "weight_decay", ADAMW_WEIGHT_DECAY);
 
-    double beta2 = ADAMW_BETA_VARIANCE;
-    if (!json_object_get(optimizer_entry, "beta2", &buffer_value))
-        json_number_get(buffer_value, &beta2);
+    bool sparse_updates = false;
+    if (!json_object_get(optimizer_entry, "sparse_updates", &buffer_value))
+        json_bool_get(buffer_value, &sparse_updates);
+    if (sparse_updates && strcmp(optimizer_name, "AdamW"))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: sparse updates are only supported by AdamW\n");
+        exit(EXIT_FAILURE);
+    }
 
-    double epsilon = ADAMW_EPSILON;
-    if (!json_object_get(optimizer_entry, "epsilon", &buffer_value))
-        json_number_get(buffer_value, &epsilon);
+    if (!strcmp(optimizer_name, "SGD"))
+        return sgd_create(
+            network->parameter_count,
+            learning_rate,
+            parse_optional_number(optimizer_entry, "momentum", SGD_MOMENTUM),
+            weight_decay
+        );
+
+    if (!strcmp(optimizer_name, "Lion"))
+        return lion_create(
+            network->parameter_count,
+            learning_rate,
+            parse_optional_number(optimizer_entry, "beta1", LION_BETA_UPDATE),
+            parse_optional_number(optimizer_entry, "beta2", LION_BETA_MOMENTUM),
+            weight_decay
+        );
+
+    if (!strcmp(optimizer_name, "Adafactor"))
+        return adafactor_create(
+            network,
+            learning_rate,
+            parse_optional_number(optimizer_entry, "epsilon", ADAFACTOR_EPSILON),
+            parse_optional_number(optimizer_entry, "decay_exponent", ADAFACTOR_DECAY_EXPONENT),
+            parse_optional_number(optimizer_entry, "clip_threshold", ADAFACTOR_CLIP_THRESHOLD),
+            weight_decay
+        );
+
+    if (!strcmp(optimizer_name, "LARS"))
+        return lars_create(
+            network->parameter_count,
+            learning_rate,
+            parse_optional_number(optimizer_entry, "momentum", SGD_MOMENTUM),
+            parse_optional_number(optimizer_entry, "trust_coefficient", LARS_TRUST_COEFFICIENT),
+            weight_decay
+        );
+
+    if (!strcmp(optimizer_name, "LAMB"))
+        return lamb_create(
+            network->parameter_count,
+            learning_rate,
+            parse_optional_number(optimizer_entry, "beta1", ADAMW_BETA_MOMENTUM),
+            parse_optional_number(optimizer_entry, "beta2", ADAMW_BETA_VARIANCE),
+            parse_optional_number(optimizer_entry, "epsilon", LAMB_EPSILON),
+            weight_decay
+        );
+
+    if (strcmp(optimizer_name, "AdamW"))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: unknown optimizer '%s'\n", optimizer_name);
+        exit(EXIT_FAILURE);
+    }
 
-    double weight_decay = ADAMW_WEIGHT_DECAY;
-    if (!json_object_get(optimizer_entry, "weight_decay", &buffer_value))
-        json_number_get(buffer_value, &weight_decay);
+    bool amsgrad = true;
+    if (!json_object_get(optimizer_entry, "amsgrad", &buffer_value))
+        json_bool_get(buffer_value, &amsgrad);
+
+    adamw_state_precision precision = ADAMW_STATE_FLOAT64;
+    const char *precision_name = "float64";
+    if (!json_object_get(optimizer_entry, "state_precision", &buffer_value))
+        json_string_get(buffer_value, &precision_name);
+    if (!strcmp(precision_name, "float32"))
+        precision = ADAMW_STATE_FLOAT32;
+    else if (!strcmp(precision_name, "int8"))
+        precision = ADAMW_STATE_INT8;
+    else if (strcmp(precision_name, "float64"))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: unknown optimizer state precision '%s'\n", precision_name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (sparse_updates && precision != ADAMW_STATE_FLOAT64)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: sparse updates require the float64 optimizer state\n");
+        exit(EXIT_FAILURE);
+    }
 
     return adamw_create(
         network->parameter_count,
         learning_rate,
-        beta1,
-        beta2,
-        epsilon,
+        parse_optional_number(optimizer_entry, "beta1", ADAMW_BETA_MOMENTUM),
+        parse_optional_number(optimizer_entry, "beta2", ADAMW_BETA_VARIANCE),
+        parse_optional_number(optimizer_entry, "epsilon", ADAMW_EPSILON),
         weight_decay,
-        true
+        amsgrad,
+        precision,
+        sparse_updates && network->layer_count ? network->layers[0] : NULL
     );
 }
 
@@ -128,6 +285,38 @@ training_parameters parse_json_for_training_options(const json_value *json_root,
     if (!json_object_get(training_entry, "batch_size", &buffer_value))
         json_number_get(buffer_value, &batch_size);
         
+    size_t accumulation_steps = parse_optional_count(training_entry, "accumulation_steps", 1);
+    if (accumulation_steps == 0)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: accumulation_steps must be at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bool huge_pages = false;
+    if (!json_object_get(training_entry, "huge_pages", &buffer_value))
+        json_bool_get(buffer_value, &huge_pages);
+
+    size_t checkpoint_every = parse_optional_count(training_entry, "checkpoint_every", 1);
+
+    bool sparse_input = true;
+    if (!json_object_get(training_entry, "sparse_input", &buffer_value))
+        json_bool_get(buffer_value, &sparse_input);
+
+    const char *state_path = NULL;
+    if (!json_object_get(training_entry, "state_path", &buffer_value))
+        json_string_get(buffer_value, &state_path);
+
+    size_t state_interval = parse_optional_count(training_entry, "state_interval", 0);
+
+    bool resume_state = false;
+    if (!json_object_get(training_entry, "resume", &buffer_value))
+        json_bool_get(buffer_value, &resume_state);
+    if (resume_state && !state_path)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: resuming requires a state_path\n");
+        exit(EXIT_FAILURE);
+    }
+
     double epoch_count = 100.0;
     if (!json_object_get(training_entry, "epoch_count", &buffer_value))
         json_number_get(buffer_value, &epoch_count);  
@@ -140,14 +329,33 @@ training_parameters parse_json_for_training_options(const json_value *json_root,
     if (!json_object_get(training_entry, "test_dataset", &buffer_value))
         json_string_get(buffer_value, &test_dataset_path);
 
+    const char *dataset_format = "csv";
+    if (!json_object_get(training_entry, "dataset_format", &buffer_value))
+        json_string_get(buffer_value, &dataset_format);
+    int (*load_dataset)(const char *filename, dataset *ds) = NULL;
+    if (!strcmp(dataset_format, "csv"))
+        load_dataset = dataset_load_csv;
+    else if (!strcmp(dataset_format, "libsvm"))
+        load_dataset = dataset_load_libsvm;
+    else
+    {
+        fprintf(stderr, PROGRAM_NAME": error: unknown dataset format '%s'\n", dataset_format);
+        exit(EXIT_FAILURE);
+    }
+    if (load_dataset == dataset_load_libsvm && layout->layer_count && layout->layers[0].type == LAYER_EMBEDDING)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: Embedding layers read their ids from CSV datasets\n");
+        exit(EXIT_FAILURE);
+    }
+
     dataset train_ds = (dataset) {
         .input_size = layout->input_size,
         .output_size = layout->layers[layout->layer_count-1].neuron_count
     };
     dataset test_ds = train_ds;
 
-    if (dataset_load_csv(train_dataset_path, &train_ds) ||
-        dataset_load_csv(test_dataset_path, &test_ds))
+    if (load_dataset(train_dataset_path, &train_ds) ||
+        load_dataset(test_dataset_path, &test_ds))
     {
         fprintf(stderr, PROGRAM_NAME": error: failed to load training dataset\n");
         exit(EXIT_FAILURE);
@@ -157,6 +365,13 @@ training_parameters parse_json_for_training_options(const json_value *json_root,
         .train_dataset = train_ds,
         .test_dataset = test_ds,
         .batch_size = batch_size,
+        .accumulation_steps = accumulation_steps,
+        .huge_pages = huge_pages,
+        .checkpoint_every = checkpoint_every,
+        .sparse_input = sparse_input,
+        .state_path = state_path,
+        .state_interval = state_interval,
+        .resume_state = resume_state,
         .epoch_count = epoch_count,
         .loss_output = NULL,
         .final_output = NULL
@@ -181,16 +396,48 @@ const loss_function* parse_json_for_loss_function(const json_value *json_root)
         return &loss_mse;
 }
 
-int main(int argc, char *argv[])
+// The kernel tuning cache of the network section, NULL when there is none.
+const char* parse_json_for_tuning_cache(const json_value *json_root)
 {
-    unsigned int seed = (unsigned int)time(NULL);
-    srand(seed);
-    printf("Using seed: %u\n", seed);
-    
-    const char *file_path = "config.json";
-    if (argc > 1)
-        file_path = argv[1];
+    json_value *network_entry = NULL, *buffer_value = NULL;
+    const char *path = NULL;
+    json_object_get(json_root, "network", &network_entry);
+    if (!json_object_get(network_entry, "tuning_cache", &buffer_value))
+        json_string_get(buffer_value, &path);
+    return path;
+}
+
+unsigned int parse_json_for_seed(const json_value *json_root)
+{
+    json_value *seed_entry = NULL;
+    double seed = 0;
+
+    // A null or missing seed means a fresh one for every run.
+    if (json_object_get(json_root, "random_seed", &seed_entry) || json_number_get(seed_entry, &seed))
+        return (unsigned int)time(NULL);
+    if (!(seed >= 0 && seed <= UINT_MAX && seed == floor(seed)))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: random_seed must be an integer from 0 to %u\n", UINT_MAX);
+        exit(EXIT_FAILURE);
+    }
+    return (unsigned int)seed;
+}
+
+// Parses a positive integer command line value, exiting on anything else.
+static size_t parse_count_argument(const char *option, const char *value)
+{
+    char *end = NULL;
+    long long count = value ? strtoll(value, &end, 10) : 0;
+    if (!value || *end || count <= 0)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: %s expects a positive integer\n", option);
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
 
+static json_value* load_config(const char *file_path)
+{
     FILE *json_file = fopen(file_path, "r");
     if (!json_file)
     {
@@ -205,15 +452,167 @@ int main(int argc, char *argv[])
         fprintf(stderr, PROGRAM_NAME": error: failed to parse JSON file: %s\n", json_error_to_string(error));
         exit(EXIT_FAILURE);
     }
+    return json_data;
+}
+
+// network serve model.bin --socket path [--max-batch n] [--max-delay-us n] [--workers n] [--tuning-cache path]
+static int serve_command(int argc, char *argv[])
+{
+    long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+    server_options options = {
+        .max_batch_size = SERVER_MAX_BATCH_SIZE,
+        .max_delay_us = SERVER_MAX_DELAY_US,
+        .worker_count = processor_count > 0 ? processor_count : 1
+    };
+    const char *model_path = NULL, *tuning_cache = NULL;
+    for (int arg_idx = 2; arg_idx < argc; ++arg_idx)
+    {
+        const char *value = arg_idx + 1 < argc ? argv[arg_idx + 1] : NULL;
+        if (!strcmp(argv[arg_idx], "--socket") && value)
+            options.socket_path = argv[++arg_idx];
+        else if (!strcmp(argv[arg_idx], "--tuning-cache") && value)
+            tuning_cache = argv[++arg_idx];
+        else if (!strcmp(argv[arg_idx], "--max-batch"))
+            options.max_batch_size = parse_count_argument(argv[arg_idx++], value);
+        else if (!strcmp(argv[arg_idx], "--max-delay-us"))
+            options.max_delay_us = parse_count_argument(argv[arg_idx++], value);
+        else if (!strcmp(argv[arg_idx], "--workers"))
+            options.worker_count = parse_count_argument(argv[arg_idx++], value);
+        else if (!model_path && argv[arg_idx][0] != '-')
+            model_path = argv[arg_idx];
+        else
+        {
+            fprintf(stderr, PROGRAM_NAME": error: unexpected argument '%s'\n", argv[arg_idx]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!model_path || !options.socket_path)
+    {
+        fprintf(stderr, "usage: "PROGRAM_NAME" serve model.bin --socket path [--max-batch n] [--max-delay-us n] [--workers n] [--tuning-cache path]\n");
+        return EXIT_FAILURE;
+    }
+
+    neural_network *network = network_load(model_path);
+    if (!network)
+        return EXIT_FAILURE;
+    if (tuning_cache && tuning_apply(network, tuning_cache, false))
+    {
+        network_free(network);
+        return EXIT_FAILURE;
+    }
+    int failed = server_run(network, &options);
+    network_free(network);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// network codegen model.bin -o model.c [--prefix name]
+static int codegen_command(int argc, char *argv[])
+{
+    const char *model_path = NULL, *output_path = NULL, *prefix = "model";
+    for (int arg_idx = 2; arg_idx < argc; ++arg_idx)
+    {
+        const char *value = arg_idx + 1 < argc ? argv[arg_idx + 1] : NULL;
+        if (!strcmp(argv[arg_idx], "-o") && value)
+            output_path = argv[++arg_idx];
+        else if (!strcmp(argv[arg_idx], "--prefix") && value)
+            prefix = argv[++arg_idx];
+        else if (!model_path && argv[arg_idx][0] != '-')
+            model_path = argv[arg_idx];
+        else
+        {
+            fprintf(stderr, PROGRAM_NAME": error: unexpected argument '%s'\n", argv[arg_idx]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!model_path || !output_path)
+    {
+        fprintf(stderr, "usage: "PROGRAM_NAME" codegen model.bin -o model.c [--prefix name]\n");
+        return EXIT_FAILURE;
+    }
+
+    neural_network *network = network_load(model_path);
+    if (!network)
+        return EXIT_FAILURE;
+    FILE *output = fopen(output_path, "w");
+    if (!output)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't open '%s': %s\n", output_path, strerror(errno));
+        network_free(network);
+        return EXIT_FAILURE;
+    }
+    int failed = codegen_write(network, prefix, output);
+    failed = fclose(output) || failed;
+    network_free(network);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// network tune config.json: times every layer shape again and rewrites the tuning cache.
+static int tune_command(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: "PROGRAM_NAME" tune config.json\n");
+        return EXIT_FAILURE;
+    }
+    json_value *json_data = load_config(argv[2]);
+    const char *tuning_cache = parse_json_for_tuning_cache(json_data);
+    if (!tuning_cache)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: '%s' sets no network.tuning_cache\n", argv[2]);
+        json_free(json_data);
+        return EXIT_FAILURE;
+    }
+
+    network_layout layout = parse_json_for_layout(json_data);
+    neural_network *network = network_create(&layout);
+    if (!network)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to allocate the network\n");
+        exit(EXIT_FAILURE);
+    }
+    int failed = tuning_apply(network, tuning_cache, true);
+    network_free(network);
+    free(layout.layers);
+    json_free(json_data);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "serve"))
+        return serve_command(argc, argv);
+    if (argc > 1 && !strcmp(argv[1], "codegen"))
+        return codegen_command(argc, argv);
+    if (argc > 1 && !strcmp(argv[1], "tune"))
+        return tune_command(argc, argv);
+
+    const char *file_path = "config.json";
+    if (argc > 1)
+        file_path = argv[1];
+    json_value *json_data = load_config(file_path);
+
+    unsigned int seed = parse_json_for_seed(json_data);
+    random_seed(seed);
+    printf("Using seed: %u\n", seed);
 
     network_layout layout = parse_json_for_layout(json_data);
 
     neural_network *network = network_create(&layout);
     network->loss = parse_json_for_loss_function(json_data);
 
-    network_initialize(network);
+    network_initialize(network, seed);
+
+    const char *tuning_cache = parse_json_for_tuning_cache(json_data);
+    if (tuning_cache && tuning_apply(network, tuning_cache, false))
+        exit(EXIT_FAILURE);
 
-    adamw *optimizer = parse_json_for_optimizer(network, json_data);
+    optimizer *optimizer = parse_json_for_optimizer(network, json_data);
+    if (!optimizer)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to allocate the optimizer\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Optimizer: %s, %.2f bytes per parameter\n", optimizer->type->name, optimizer_bytes_per_parameter(optimizer));
 
     FILE *loss = fopen("loss.csv", "w");
     FILE *final_output = fopen("scatter.csv", "w");
@@ -222,21 +621,30 @@ int main(int argc, char *argv[])
     train_param.loss_output = loss;
     train_param.final_output = final_output;
 
-    json_free(json_data);
+    json_value *training_entry = NULL, *buffer_value = NULL;
+    const char *model_path = NULL;
+    json_object_get(json_data, "training", &training_entry);
+    if (!json_object_get(training_entry, "save_model", &buffer_value))
+        json_string_get(buffer_value, &model_path);
 
     printf("Starting training...\n");
-    network_train(network, optimizer, &train_param);
+    if (network_train(network, optimizer, &train_param))
+        exit(EXIT_FAILURE);
     printf("Training finished successfully\n");
 
+    if (model_path && network_save(network, model_path))
+        exit(EXIT_FAILURE);
+    json_free(json_data);
+
     fclose(loss);
     fclose(final_output);
 
-    adamw_free(optimizer);
+    optimizer_free(optimizer);
 
     network_free(network);
 
-    free(train_param.train_dataset.data);
-    free(train_param.test_dataset.data);
+    dataset_free(&train_param.train_dataset);
+    dataset_free(&train_param.test_dataset);
     
     return 0;
 }
\ No newline at end of file
@@ -1,15 +1,42 @@
+#define _DEFAULT_SOURCE // random, initstate and setstate
 #include "math_utils.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <float.h>
 #include <math.h>
+#include <string.h>
 
 #include "hyperparameters.h"
 
+// State of the generator behind random(); initstate keeps it in this buffer, which
+// setstate also updates with the current position so that it can be copied as is.
+static char random_state[RANDOM_STATE_SIZE];
+
+void random_seed(unsigned int seed)
+{
+    initstate(seed, random_state, sizeof(random_state));
+}
+
+void random_state_save(char state[RANDOM_STATE_SIZE])
+{
+    setstate(random_state);
+    memcpy(state, random_state, sizeof(random_state));
+}
+
+void random_state_restore(const char state[RANDOM_STATE_SIZE])
+{
+    // setstate records the position of the current state before switching, so the generator
+    // has to leave random_state before it is overwritten.
+    char scratch[RANDOM_STATE_SIZE];
+    initstate(1, scratch, sizeof(scratch));
+    memcpy(random_state, state, sizeof(random_state));
+    setstate(random_state);
+}
+
 double rand_double()
 {
-    return (double)rand() / RAND_MAX;
+    return (double)random() / RAND_MAX;
 }
 
 double rand_double_in_range(double a, double b)
@@ -27,6 +54,87 @@ double sample_gaussian_distribution(double mu, double sigma)
     return mu + sigma * sqrt(-2 * log(u1)) * cos(2 * M_PI * rand_double());
 }
 
+#define PHILOX_M0 UINT32_C(0xD2511F53)
+#define PHILOX_M1 UINT32_C(0xCD9E8D57)
+#define PHILOX_W0 UINT32_C(0x9E3779B9)
+#define PHILOX_W1 UINT32_C(0xBB67AE85)
+#define PHILOX_ROUNDS 10
+
+// One Philox4x32-10 block: 128 random bits for counter (block, stream) under key seed.
+static inline void philox4x32(uint64_t block, uint64_t stream, uint64_t seed, uint64_t out[2])
+{
+    uint32_t c0 = (uint32_t)block, c1 = (uint32_t)(block >> 32);
+    uint32_t c2 = (uint32_t)stream, c3 = (uint32_t)(stream >> 32);
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+
+    for (int round = 0; round < PHILOX_ROUNDS; ++round)
+    {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        uint32_t hi0 = (uint32_t)(p0 >> 32), lo0 = (uint32_t)p0;
+        uint32_t hi1 = (uint32_t)(p1 >> 32), lo1 = (uint32_t)p1;
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    out[0] = (uint64_t)c0 << 32 | c1;
+    out[1] = (uint64_t)c2 << 32 | c3;
+}
+
+// Maps 64 random bits to a double in the open interval (0, 1).
+static inline double bits_to_open_unit(uint64_t bits)
+{
+    return ((double)(bits >> 11) + 0.5) * 0x1p-53;
+}
+
+void counter_fill_uniform(double *dst, size_t count, double a, double b, uint64_t seed, uint64_t stream)
+{
+    // Each block yields two values, so element i comes from block i/2.
+    size_t block_count = (count + 1) / 2;
+    #pragma omp parallel for simd schedule(static)
+    for (size_t block = 0; block < block_count; ++block)
+    {
+        uint64_t bits[2];
+        philox4x32(block, stream, seed, bits);
+        dst[2 * block] = a + (b - a) * bits_to_open_unit(bits[0]);
+        if (2 * block + 1 < count)
+            dst[2 * block + 1] = a + (b - a) * bits_to_open_unit(bits[1]);
+    }
+}
+
+void counter_fill_gaussian(double *dst, size_t count, double mu, double sigma, uint64_t seed, uint64_t stream)
+{
+    // Box-Muller transform, using both the cosine and sine outputs of each block.
+    size_t block_count = (count + 1) / 2;
+    #pragma omp parallel for simd schedule(static)
+    for (size_t block = 0; block < block_count; ++block)
+    {
+        uint64_t bits[2];
+        philox4x32(block, stream, seed, bits);
+        double radius = sigma * sqrt(-2 * log(bits_to_open_unit(bits[0])));
+        double angle = 2 * M_PI * bits_to_open_unit(bits[1]);
+        dst[2 * block] = mu + radius * cos(angle);
+        if (2 * block + 1 < count)
+            dst[2 * block + 1] = mu + radius * sin(angle);
+    }
+}
+
+// Vectors shorter than this are reduced by the calling thread only.
+#define NORM_PARALLEL_THRESHOLD 16384
+
+double squared_norm(const double *values, size_t count)
+{
+    double sum = 0;
+    #pragma omp parallel for simd schedule(static) reduction(+:sum) if(count >= NORM_PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i)
+        sum += values[i] * values[i];
+    return sum;
+}
+
 static void memswap(void *a, void *b, size_t num)
 {
     for (uint_fast8_t *p = a, *q = b, *sentry = p + num; p < sentry; ++p, ++q)
@@ -42,7 +150,7 @@ void shuffle(void *array, size_t count, size_t element_size)
     uint_fast8_t *char_array = array;
     for (size_t i = count; i > 1; --i)
     {
-        int j = rand() % i;
+        size_t j = random() % i;
         memswap(char_array + element_size*(i-1), char_array + element_size*j, element_size);
     }
 }
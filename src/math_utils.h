@@ -6,11 +6,29 @@
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
+
+// Size of the generator state behind rand_double and shuffle; with this size, random_seed
+// gives the same sequence as srandom.
+#define RANDOM_STATE_SIZE 128
+
+void random_seed(unsigned int seed);
+// Copies of the generator state, for a training run to resume with the same sequence.
+void random_state_save(char state[RANDOM_STATE_SIZE]);
+void random_state_restore(const char state[RANDOM_STATE_SIZE]);
 
 double rand_double();
 double rand_double_in_range(double a, double b);
 double sample_gaussian_distribution(double mu, double sigma);
 
+// Counter-based (Philox4x32-10) generators: element i of the output only depends on
+// (seed, stream, i), so the fill can be split across threads and SIMD lanes freely.
+void counter_fill_uniform(double *dst, size_t count, double a, double b, uint64_t seed, uint64_t stream);
+void counter_fill_gaussian(double *dst, size_t count, double mu, double sigma, uint64_t seed, uint64_t stream);
+
+// Parallel sum of squares, for per-layer norms.
+double squared_norm(const double *values, size_t count);
+
 void shuffle(void *array, size_t count, size_t element_size);
 
-#endif // MATH_UTILS_H
\ No newline at end of file
+#endif // MATH_UTILS_H
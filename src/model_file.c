@@ -0,0 +1,269 @@
+#include "model_file.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "layer.h"
+#include "loss.h"
+#include "constants.h"
+
+#define MODEL_FILE_MAGIC "NNMODEL"
+#define MODEL_FILE_VERSION 2
+#define MODEL_FILE_BYTE_ORDER 0x01020304u
+// Parameters start on a page so that they can be used in place from the mapping.
+#define MODEL_FILE_ALIGNMENT 4096
+
+typedef struct model_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t input_size;
+    uint64_t layer_count;
+    uint64_t parameter_count;
+    uint64_t parameters_offset;
+    uint32_t loss_id;
+    uint32_t inference_activations;
+} model_file_header;
+
+typedef struct model_file_layer {
+    uint64_t neuron_count; // Units of an embedding
+    uint32_t activation_id;
+    uint32_t initialization_id;
+    uint32_t type;         // A layer_type
+    uint32_t padding;
+    uint64_t vocabulary_size;
+} model_file_layer;
+
+_Static_assert(MODEL_FILE_ALIGNMENT % MEMORY_ALIGNMENT == 0, "parameters must stay aligned in the file");
+
+// The ids are the indices in these tables: new entries go at the end.
+static const activation_pair *const activations[] = {
+    &activation_linear, &activation_sigmoid, &activation_tanh, &activation_relu,
+    &activation_leaky_relu, &activation_swish, &activation_softmax
+};
+static const initialization_function initializations[] = {
+    initialization_xavier, initialization_he
+};
+static const loss_function *const losses[] = {
+    &loss_bce, &loss_bce_sigmoid, &loss_cce_softmax, &loss_mse
+};
+
+#define ID_COUNT(table) (sizeof(table) / sizeof(*(table)))
+
+static uint32_t activation_id(const activation_pair *pair)
+{
+    for (uint32_t id = 0; id < ID_COUNT(activations); ++id)
+        if (activations[id]->base == pair->base)
+            return id;
+    return UINT32_MAX;
+}
+
+static uint32_t initialization_id(initialization_function initialization)
+{
+    for (uint32_t id = 0; id < ID_COUNT(initializations); ++id)
+        if (initializations[id] == initialization)
+            return id;
+    return UINT32_MAX;
+}
+
+static uint32_t loss_id(const loss_function *loss)
+{
+    for (uint32_t id = 0; id < ID_COUNT(losses); ++id)
+        if (losses[id] == loss)
+            return id;
+    return UINT32_MAX;
+}
+
+static size_t parameters_offset(size_t layer_count)
+{
+    size_t bytes = sizeof(model_file_header) + layer_count * sizeof(model_file_layer);
+    return (bytes + MODEL_FILE_ALIGNMENT - 1) / MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT;
+}
+
+int network_save(const neural_network *network, const char *path)
+{
+    model_file_header header = {
+        .magic = MODEL_FILE_MAGIC,
+        .version = MODEL_FILE_VERSION,
+        .byte_order = MODEL_FILE_BYTE_ORDER,
+        .input_size = network->input_size,
+        .layer_count = network->layer_count,
+        .parameter_count = network->parameter_count,
+        .parameters_offset = parameters_offset(network->layer_count),
+        .loss_id = loss_id(network->loss),
+        .inference_activations = network->inference_activations
+    };
+    if (header.loss_id == UINT32_MAX)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't save '%s': unknown loss function\n", path);
+        return true;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't open '%s': %s\n", path, strerror(errno));
+        return true;
+    }
+
+    bool failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count && !failed; ++layer_idx)
+    {
+        const layer *layer = network->layers[layer_idx];
+        model_file_layer record = {
+            .neuron_count = layer->type == LAYER_EMBEDDING ? layer->weight_columns : layer->output_size,
+            .activation_id = activation_id(&layer->activation_pair),
+            .initialization_id = initialization_id(layer->initialization_function),
+            .type = layer->type,
+            .vocabulary_size = layer->vocabulary_size
+        };
+        if (record.activation_id == UINT32_MAX || record.initialization_id == UINT32_MAX)
+        {
+            fprintf(stderr, PROGRAM_NAME": error: can't save '%s': layer %zu has an unknown activation or initialization\n", path, layer_idx);
+            fclose(file);
+            return true;
+        }
+        failed = fwrite(&record, sizeof(record), 1, file) != 1;
+    }
+
+    // Zero padding up to the parameters.
+    for (long position = ftell(file); position >= 0 && (uint64_t)position < header.parameters_offset && !failed; ++position)
+        failed = fputc(0, file) == EOF;
+
+    failed = failed || fwrite(network->parameters, sizeof(double), network->parameter_count, file) != network->parameter_count;
+    failed = fclose(file) || failed;
+    if (failed)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to write '%s': %s\n", path, strerror(errno));
+        return true;
+    }
+    return false;
+}
+
+// Returns the reason why the mapped file is not a valid model, NULL if it is one.
+static const char* check_model(const char *mapping, size_t size)
+{
+    if (size < sizeof(model_file_header))
+        return "file too short";
+
+    const model_file_header *header = (const model_file_header*)mapping;
+    if (memcmp(header->magic, MODEL_FILE_MAGIC, sizeof(header->magic)))
+        return "not a model file";
+    if (header->byte_order != MODEL_FILE_BYTE_ORDER)
+        return "saved on a host with another byte order";
+    if (header->version != MODEL_FILE_VERSION)
+        return "unsupported format version";
+    if (header->layer_count == 0 || header->layer_count > (size - sizeof(*header)) / sizeof(model_file_layer))
+        return "truncated layout";
+    if (header->input_size == 0 || header->input_size > size / sizeof(double))
+        return "input size doesn't fit in the file";
+    if (header->loss_id >= ID_COUNT(losses) || header->inference_activations > ACTIVATION_BACKEND_TABLE)
+        return "unknown loss function or activation backend";
+
+    const model_file_layer *records = (const model_file_layer*)(header + 1);
+    uint64_t input_size = header->input_size, parameter_count = 0;
+    for (uint64_t layer_idx = 0; layer_idx < header->layer_count; ++layer_idx)
+    {
+        const model_file_layer *record = &records[layer_idx];
+        if (record->activation_id >= ID_COUNT(activations) || record->initialization_id >= ID_COUNT(initializations))
+            return "unknown activation or initialization";
+        if (record->type > LAYER_EMBEDDING || (record->type == LAYER_EMBEDDING
+            && (layer_idx != 0 || record->vocabulary_size == 0 || record->vocabulary_size > UINT32_MAX)))
+            return "unknown layer type or misplaced embedding";
+        // Checked before multiplying, so that the count can't overflow. An embedding holds a bias
+        // per input and unit, and a row of units per id and for unknown ids.
+        uint64_t rows_per_unit = record->type == LAYER_EMBEDDING ? input_size + record->vocabulary_size + 1 : input_size + 1;
+        if (record->vocabulary_size > size / sizeof(double) || record->neuron_count == 0
+            || record->neuron_count > size / sizeof(double) / rows_per_unit)
+            return "layer sizes don't fit in the file";
+        parameter_count += layer_parameter_count(record->type, input_size, record->neuron_count, record->vocabulary_size);
+        input_size = layer_output_size(record->type, input_size, record->neuron_count);
+    }
+
+    if (parameter_count != header->parameter_count)
+        return "parameter count doesn't match the layout";
+    if (header->parameters_offset != parameters_offset(header->layer_count)
+        || header->parameters_offset > size
+        || parameter_count > (size - header->parameters_offset) / sizeof(double))
+        return "truncated parameters";
+    return NULL;
+}
+
+model_file_status network_map(const char *path, neural_network **network, const char **reason)
+{
+    *network = NULL;
+    int fd = open(path, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status))
+    {
+        *reason = strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return MODEL_FILE_UNREADABLE;
+    }
+
+    // Private and writable: training a loaded model copies the pages it changes, never the file.
+    size_t size = status.st_size;
+    char *mapping = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        *reason = size ? strerror(errno) : "empty file";
+        return size ? MODEL_FILE_UNREADABLE : MODEL_FILE_INVALID;
+    }
+
+    *reason = check_model(mapping, size);
+    if (*reason)
+    {
+        munmap(mapping, size);
+        return MODEL_FILE_INVALID;
+    }
+
+    const model_file_header *header = (const model_file_header*)mapping;
+    const model_file_layer *records = (const model_file_layer*)(header + 1);
+    network_layout layout = {
+        .input_size = header->input_size,
+        .layer_count = header->layer_count,
+        .layers = malloc(header->layer_count * sizeof(struct layer_layout)),
+        .inference_activations = header->inference_activations
+    };
+    if (layout.layers)
+    {
+        for (size_t layer_idx = 0; layer_idx < layout.layer_count; ++layer_idx)
+        {
+            layout.layers[layer_idx] = (struct layer_layout) {
+                .neuron_count = records[layer_idx].neuron_count,
+                .initialization_function = initializations[records[layer_idx].initialization_id],
+                .activation_pair = *activations[records[layer_idx].activation_id],
+                .type = records[layer_idx].type,
+                .vocabulary_size = records[layer_idx].vocabulary_size
+            };
+        }
+        *network = network_create_mapped(&layout, mapping, size, (double*)(mapping + header->parameters_offset));
+        free(layout.layers);
+    }
+    if (!*network)
+    {
+        *reason = "out of memory";
+        munmap(mapping, size);
+        return MODEL_FILE_OUT_OF_MEMORY;
+    }
+    (*network)->loss = losses[header->loss_id];
+    return MODEL_FILE_OK;
+}
+
+neural_network* network_load(const char *path)
+{
+    neural_network *network;
+    const char *reason;
+    if (network_map(path, &network, &reason))
+        fprintf(stderr, PROGRAM_NAME": error: can't load '%s': %s\n", path, reason);
+    return network;
+}
@@ -0,0 +1,31 @@
+#ifndef MODEL_FILE_H
+#define MODEL_FILE_H
+
+#include <stdbool.h>
+
+#include "network.h"
+
+// Versioned binary model: a header with the layout (types, sizes, activation, initialization
+// and loss ids), then every parameter as in the network's arena, starting on a page boundary.
+// Doubles and integers are stored in host byte order; a file from a host with another byte
+// order or a different format version is rejected rather than converted.
+
+// Returns true on failure, after printing the reason.
+int network_save(const neural_network *network, const char *path);
+
+// Maps the file and uses its parameters in place, without parsing nor copying them: pages
+// are read on first use and shared with the page cache until the network writes to them,
+// which then only affects this process. Returns NULL on failure, after printing the reason.
+neural_network* network_load(const char *path);
+
+typedef enum model_file_status {
+    MODEL_FILE_OK,
+    MODEL_FILE_UNREADABLE,   // The file can't be opened or mapped
+    MODEL_FILE_INVALID,      // Not a model file this version can load
+    MODEL_FILE_OUT_OF_MEMORY
+} model_file_status;
+
+// The same, printing nothing: on failure *network is NULL and *reason describes the problem.
+model_file_status network_map(const char *path, neural_network **network, const char **reason);
+
+#endif // MODEL_FILE_H
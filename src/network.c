@@ -3,72 +3,127 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "layer.h"
 #include "loss.h"
 #include "batch_buffer.h"
 #include "dataset.h"
 #include "math_utils.h"
-#include "adamw.h"
+#include "optimizer.h"
+#include "constants.h"
+#include "activation_table.h"
+#include "training_state.h"
 
-neural_network* network_create(network_layout *layout)
+size_t network_parameter_count(const network_layout *layout)
+{
+    size_t parameter_count = 0;
+    size_t input_size = layout->input_size;
+    for (size_t i = 0; i < layout->layer_count; ++i)
+    {
+        const struct layer_layout *layer_layout = &layout->layers[i];
+        parameter_count += layer_parameter_count(layer_layout->type, input_size, layer_layout->neuron_count, layer_layout->vocabulary_size);
+        input_size = layer_output_size(layer_layout->type, input_size, layer_layout->neuron_count);
+    }
+    return parameter_count;
+}
+
+// Creates the network and its layers as views into the given parameters.
+static neural_network* create(network_layout *layout, double *parameters)
 {
-    // Allocate memory for the network and initialize parameters.
     neural_network *network = malloc(sizeof(neural_network) + layout->layer_count * sizeof(layer*));
     if (!network) return NULL;
 
     *network = (neural_network) {
         .input_size = layout->input_size,
+        .parameter_count = network_parameter_count(layout),
+        .parameters = parameters,
+        .inference_activations = layout->inference_activations,
         .layer_count = layout->layer_count,
     };
 
-    // Create and add layers using the layout.
-    size_t parameter_count = 0;
+    if (network->inference_activations == ACTIVATION_BACKEND_TABLE)
+        activation_tables_build();
+
     for (size_t i = 0; i < layout->layer_count; ++i)
     {
         layer *new_layer = layer_create(
+            layout->layers[i].type,
             (i > 0) ? network->layers[i-1]->output_size : network->input_size,
             layout->layers[i].neuron_count,
+            layout->layers[i].vocabulary_size,
             layout->layers[i].initialization_function,
-            layout->layers[i].activation_pair
+            layout->layers[i].activation_pair,
+            parameters
         );
         network->layers[i] = new_layer;
-        parameter_count += new_layer->parameter_count;
+        parameters += new_layer->parameter_count;
     }
-    network->parameter_count = parameter_count;
 
     return network;
 }
 
+neural_network* network_create(network_layout *layout)
+{
+    // aligned_alloc requires a size that is a multiple of the alignment.
+    size_t arena_size = ALIGN_SIZE(network_parameter_count(layout) * sizeof(double));
+    double *parameters = aligned_alloc(MEMORY_ALIGNMENT, arena_size ? arena_size : MEMORY_ALIGNMENT);
+    if (!parameters) return NULL;
+
+    neural_network *network = create(layout, parameters);
+    if (!network)
+        free(parameters);
+    return network;
+}
+
+neural_network* network_create_mapped(network_layout *layout, void *mapping, size_t mapping_size, double *parameters)
+{
+    neural_network *network = create(layout, parameters);
+    if (network)
+    {
+        network->mapping = mapping;
+        network->mapping_size = mapping_size;
+    }
+    return network;
+}
+
 void network_free(neural_network *network)
 {
-    // Free all layers then the network itself.
+    // Free all layers, the parameter arena or its mapping, then the network itself.
     for (size_t i = 0; i < network->layer_count; ++i)
         layer_free(network->layers[i]);
+    if (network->mapping)
+        munmap(network->mapping, network->mapping_size);
+    else
+        free(network->parameters);
     free(network);
 }
 
-neural_network* network_initialize(neural_network *network)
+neural_network* network_initialize(neural_network *network, uint64_t seed)
 {
     // Initialize each layer via its initialization_function.
     for (size_t i = 0; i < network->layer_count; ++i)
     {
         layer *current_layer = network->layers[i];
-        current_layer->initialization_function(current_layer);
+        current_layer->initialization_function(current_layer, seed, i);
     }
     return network;
 }
 
-void network_infer(neural_network *network, double *input, double *output)
+batch_arena* network_inference_context_create(const neural_network *network)
 {
-    batch_buffer *buffer = batch_buffer_create(network);
-    batch_buffer_forward(network, buffer, input);
+    return batch_arena_create(network, 1, false, 1, INPUT_FORMAT_GATHERED);
+}
+
+void network_infer(const neural_network *network, batch_arena *context, const double *input, double *output)
+{
+    batch_buffer *buffer = context->samples[0];
+    batch_buffer_infer(buffer, input);
     memcpy(output, buffer->layers[network->layer_count - 1]->activations, network->layers[network->layer_count - 1]->output_size * sizeof(double));
-    batch_buffer_free(buffer);
 }
 
 // Helper function to find the index of the maximum value in an array.
-static size_t argmax(double *array, size_t size)
+static size_t argmax(const double *array, size_t size)
 {
     double max = array[0];
     size_t max_idx = 0;
@@ -83,106 +138,261 @@ static size_t argmax(double *array, size_t size)
     return max_idx;
 }
 
-static void fprint_epoch_stats(FILE *file, neural_network *network, dataset *ds, size_t epoch_count)
+// Expected outputs of an entry of a dense or sparse dataset.
+static const double *entry_outputs(const dataset *ds, size_t entry_idx)
+{
+    if (!ds->data)
+        return ds->outputs + ds->output_size * entry_idx;
+    return ds->data + ds->entry_size * entry_idx + ds->input_size;
+}
+
+static void infer_entry(const neural_network *network, batch_arena *context, const dataset *ds, size_t entry_idx, double *output)
+{
+    if (ds->data)
+    {
+        network_infer(network, context, ds->data + ds->entry_size * entry_idx, output);
+        return;
+    }
+    size_t begin = ds->row_offsets[entry_idx], count = ds->row_offsets[entry_idx + 1] - begin;
+    batch_buffer *buffer = context->samples[0];
+    batch_buffer_infer_sparse(buffer, count, ds->indices + begin, ds->values + begin);
+    memcpy(output, buffer->layers[network->layer_count - 1]->activations, network->layers[network->layer_count - 1]->output_size * sizeof(double));
+}
+
+// Sparse entries are read straight from the dataset's lists by the first layer.
+static void forward_entry(batch_arena *arena, size_t sample_idx, const dataset *ds, size_t entry_idx)
 {
-    if (file == NULL)
+    if (ds->data)
+    {
+        batch_arena_forward(arena, sample_idx, ds->data + ds->entry_size * entry_idx);
         return;
+    }
+    size_t begin = ds->row_offsets[entry_idx], count = ds->row_offsets[entry_idx + 1] - begin;
+    batch_arena_forward_sparse(arena, sample_idx, count, ds->indices + begin, ds->values + begin);
+}
+
+// Outputs of the exact forward pass that training optimizes, whatever the inference backend.
+static void evaluate_entry(const neural_network *network, batch_arena *context, const dataset *ds, size_t entry_idx, double *output)
+{
+    forward_entry(context, 0, ds, entry_idx);
+    memcpy(output, context->forward_samples[0]->layers[network->layer_count - 1]->activations, network->layers[network->layer_count - 1]->output_size * sizeof(double));
+}
 
+// Sparse datasets have no dense inputs to fall back on, nor to gather.
+static input_format dataset_input_format(const dataset *ds, bool sparse_input)
+{
+    if (!ds->data)
+        return INPUT_FORMAT_SPARSE;
+    return sparse_input ? INPUT_FORMAT_GATHERED : INPUT_FORMAT_DENSE;
+}
+
+// Validation loss and accuracy of the exact forward pass; returns true if the buffers can't be allocated.
+static bool evaluate_dataset(const neural_network *network, const dataset *ds, double *loss, double *accuracy)
+{
     double total_loss = 0;
 
     double *result = malloc(ds->output_size * sizeof(double));
-    double accuracy = 0;
-    if (!result) return;
+    batch_arena *context = batch_arena_create(network, 1, false, 1, dataset_input_format(ds, true));
+    size_t correct_count = 0;
+    if (!result || !context)
+    {
+        free(result);
+        if (context)
+            batch_arena_free(context);
+        return true;
+    }
 
     for (size_t entry_idx = 0; entry_idx < ds->entry_count; ++entry_idx)
     {
-        double *entry_input = ds->data + ds->entry_size * entry_idx;
-        double *entry_output = entry_input + ds->input_size;
-
-        network_infer(network, entry_input, result);
+        const double *entry_output = entry_outputs(ds, entry_idx);
+        evaluate_entry(network, context, ds, entry_idx, result);
         total_loss += network->loss->compute_loss(result, entry_output, ds->output_size);
         if (argmax(entry_output, ds->output_size) == argmax(result, ds->output_size))
-            accuracy++;
+            correct_count++;
     }
     free(result);
+    batch_arena_free(context);
 
-    double avg_loss = total_loss / ds->entry_count;
-    fprintf(file, "%zu,%f,%f\n", epoch_count, avg_loss, accuracy / ds->entry_count);
+    *loss = total_loss / ds->entry_count;
+    *accuracy = (double)correct_count / ds->entry_count;
+    return false;
+}
+
+static void fprint_epoch_stats(FILE *file, size_t epoch_count, double loss, double accuracy)
+{
+    fprintf(file, "%zu,%f,%f\n", epoch_count, loss, accuracy);
 }
 
-static void fprint_network_output(FILE *file, neural_network *network, dataset *ds)
+// Sparse entries are written without their inputs, which could be millions of columns.
+static void fprint_network_output(FILE *file, const neural_network *network, const dataset *ds)
 {
     double *result = malloc(ds->output_size * sizeof(double));
-    if (!result) return;
-    
+    batch_arena *context = batch_arena_create(network, 1, false, 1, dataset_input_format(ds, true));
+    if (!result || !context)
+    {
+        free(result);
+        if (context)
+            batch_arena_free(context);
+        return;
+    }
+
     for (size_t entry_idx = 0; entry_idx < ds->entry_count; ++entry_idx)
     {
-        double *entry_input = ds->data + ds->entry_size * entry_idx;
-        double *entry_output = entry_input + ds->input_size;
-        network_infer(network, entry_input, result);
+        const double *entry_output = entry_outputs(ds, entry_idx);
+        infer_entry(network, context, ds, entry_idx, result);
 
-        for (size_t input_field_idx = 0; input_field_idx < ds->input_size; ++input_field_idx)
-            fprintf(file, (input_field_idx > 0) ? ",%f" : "%f", entry_input[input_field_idx]);
+        if (ds->data)
+            for (size_t input_field_idx = 0; input_field_idx < ds->input_size; ++input_field_idx)
+                fprintf(file, "%f,", ds->data[ds->entry_size * entry_idx + input_field_idx]);
         for (size_t expcted_field_idx = 0; expcted_field_idx < ds->output_size; ++expcted_field_idx)
-            fprintf(file, ",%f", entry_output[expcted_field_idx]);
+            fprintf(file, (expcted_field_idx > 0) ? ",%f" : "%f", entry_output[expcted_field_idx]);
         for (size_t output_field_idx = 0; output_field_idx < ds->output_size; ++output_field_idx)
             fprintf(file, ",%f", result[output_field_idx]);
         fputc('\n', file);
     }
     free(result);
+    batch_arena_free(context);
 }
 
-void network_train(neural_network *network, adamw *optimizer, training_parameters *options)
+int network_train(neural_network *network, optimizer *optimizer, training_parameters *options)
 {
-    if (network->layer_count == 0)
-        return;
+    if (network->layer_count == 0 || options->train_dataset.entry_count == 0)
+        return false;
     
     size_t batch_size = options->batch_size;
-    batch_buffer **buffers = malloc(sizeof(batch_buffer*) * batch_size);
-    for (size_t buffer_idx = 0; buffer_idx < batch_size; ++buffer_idx)
-        buffers[buffer_idx] = batch_buffer_create(network);
-
+    size_t accumulation_steps = options->accumulation_steps;
     dataset *training_ds = &options->train_dataset;
     dataset *validation_ds = &options->test_dataset;
 
+    // Entries are visited through a shuffled index, which is part of the training state.
+    training_position position = {
+        .entry_count = training_ds->entry_count,
+        .order = malloc(training_ds->entry_count * sizeof(size_t)),
+        .batch_size = batch_size,
+        .accumulation_steps = accumulation_steps
+    };
+    batch_arena *arena = batch_arena_create(network, batch_size, options->huge_pages, options->checkpoint_every, dataset_input_format(training_ds, options->sparse_input));
+    if (!arena || !position.order)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to allocate the batch buffers\n");
+        if (arena)
+            batch_arena_free(arena);
+        free(position.order);
+        return true;
+    }
+    printf("Activation memory: %zu bytes per minibatch (%zu without planning)%s\n",
+        arena->planned_bytes, arena->unplanned_bytes, arena->mapped_bytes ? ", on huge pages" : "");
+
+    for (size_t entry_idx = 0; entry_idx < training_ds->entry_count; ++entry_idx)
+        position.order[entry_idx] = entry_idx;
+
+    // A resumed epoch continues where the state was saved, with its shuffle already done.
+    bool resumed = false;
+    if (options->resume_state)
+    {
+        if (training_state_load(options->state_path, network, optimizer, &position))
+        {
+            batch_arena_free(arena);
+            free(position.order);
+            return true;
+        }
+        random_state_restore(position.random_state);
+        resumed = true;
+        printf("Resuming at epoch %zu, entry %zu\n", position.epoch_idx + 1, position.entry_idx);
+    }
+
+    training_state_writer *state_writer = NULL;
+    if (options->state_path && options->state_interval)
+    {
+        state_writer = training_state_writer_create(options->state_path, network, optimizer, training_ds->entry_count);
+        if (!state_writer)
+            fprintf(stderr, PROGRAM_NAME": error: failed to start saving the training state\n");
+    }
+
     if (options->loss_output != NULL)
         fputs("epoch,loss,accuracy\n", options->loss_output);
-    for (size_t epoch_idx = 0; epoch_idx < options->epoch_count; ++epoch_idx)
+    size_t steps_since_state = 0;
+    for (size_t epoch_idx = position.epoch_idx; epoch_idx < options->epoch_count; ++epoch_idx)
     {
-        fprint_epoch_stats(options->loss_output, network, validation_ds, epoch_idx);
-        
-        shuffle(training_ds->data, training_ds->entry_count, training_ds->entry_size * sizeof(double));
-        for (size_t entry_idx = 0; entry_idx + batch_size <= training_ds->entry_count;)
+        // The row of a resumed epoch is the one evaluated at its start, saved with the state, so
+        // that the loss file matches an uninterrupted run.
+        size_t first_entry_idx = 0;
+        if (resumed)
+            first_entry_idx = position.entry_idx;
+        else
+        {
+            optimizer_synchronize(optimizer, network);
+            position.epoch_evaluated = options->loss_output != NULL
+                && !evaluate_dataset(network, validation_ds, &position.epoch_loss, &position.epoch_accuracy);
+            shuffle(position.order, training_ds->entry_count, sizeof(size_t));
+        }
+        resumed = false;
+        if (options->loss_output != NULL && position.epoch_evaluated)
+            fprint_epoch_stats(options->loss_output, epoch_idx, position.epoch_loss, position.epoch_accuracy);
+
+        size_t pending_micro_batches = 0;
+        optimizer_zero_gradient(optimizer);
+        for (size_t entry_idx = first_entry_idx; entry_idx + batch_size <= training_ds->entry_count;)
         {
             for (size_t buffer_idx = 0; buffer_idx < batch_size; ++buffer_idx, ++entry_idx)
             {
-                double *entry_input = training_ds->data + training_ds->entry_size * entry_idx;
-                double *entry_output = entry_input + training_ds->input_size;
-
-                batch_buffer *buffer = buffers[buffer_idx];
-                batch_buffer_forward(network, buffer, entry_input);
+                const double *entry_output = entry_outputs(training_ds, position.order[entry_idx]);
+                forward_entry(arena, buffer_idx, training_ds, position.order[entry_idx]);
+                batch_buffer *buffer = arena->samples[buffer_idx];
 
                 size_t ouput_layer_idx = network->layer_count - 1;
                 struct batch_buffer_layer_data *output_layer_data = buffer->layers[ouput_layer_idx];
                 const layer *output_layer = network->layers[ouput_layer_idx];
                 network->loss->compute_output_gradient(output_layer, output_layer_data, entry_output);
-                
-                batch_buffer_backpropagate(network, buffer);
             }
 
-            adamw_merge_batch(optimizer, buffers, batch_size);
+            // Backward one layer at a time over the whole micro-batch, merging each layer's
+            // gradient before the plan lets its buffers be reused.
+            for (size_t layer_idx = network->layer_count; layer_idx-- > 0;)
+            {
+                batch_arena_recompute(arena, layer_idx);
+                optimizer_merge_layer(optimizer, network, arena, layer_idx);
+                if (layer_idx > 0)
+                    for (size_t buffer_idx = 0; buffer_idx < batch_size; ++buffer_idx)
+                        batch_buffer_backpropagate_layer(arena->samples[buffer_idx], layer_idx);
+            }
+
+            // Only one micro-batch of activations is kept; its gradient is summed until the step.
+            if (++pending_micro_batches == accumulation_steps)
+            {
+                optimizer_update_params(optimizer, network);
+                optimizer_zero_gradient(optimizer);
+                pending_micro_batches = 0;
 
-            adamw_update_params(optimizer, network);
+                // Between two steps, the gradient is empty and not part of the state.
+                if (state_writer && ++steps_since_state == options->state_interval)
+                {
+                    position.epoch_idx = epoch_idx;
+                    position.entry_idx = entry_idx;
+                    random_state_save(position.random_state);
+                    training_state_snapshot(state_writer, network, optimizer, &position);
+                    steps_since_state = 0;
+                }
+            }
         }
 
+        // Flush the last, incomplete accumulation of the epoch.
+        if (pending_micro_batches > 0)
+            optimizer_update_params(optimizer, network);
+
         printf("Epoch %zu done...\n", epoch_idx+1);
     }
-    fprint_epoch_stats(options->loss_output, network, validation_ds, options->epoch_count);
+    optimizer_synchronize(optimizer, network);
+    double loss, accuracy;
+    if (options->loss_output != NULL && !evaluate_dataset(network, validation_ds, &loss, &accuracy))
+        fprint_epoch_stats(options->loss_output, options->epoch_count, loss, accuracy);
 
-    for (size_t buffer_idx = 0; buffer_idx < batch_size; ++buffer_idx)
-        batch_buffer_free(buffers[buffer_idx]);
-    free(buffers);
+    if (state_writer)
+        training_state_writer_free(state_writer);
+    batch_arena_free(arena);
+    free(position.order);
 
     if (options->final_output != NULL)
         fprint_network_output(options->final_output, network, validation_ds);
+    return false;
 }
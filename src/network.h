@@ -4,50 +4,75 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "initialization.h"
 #include "activation.h"
 #include "dataset.h"
+#include "layer.h"
 
-typedef struct layer layer;
 typedef struct loss_function loss_function;
-typedef struct adamw adamw;
+typedef struct optimizer optimizer;
+typedef struct batch_arena batch_arena;
 
 typedef struct network_layout {
     size_t input_size;
     size_t layer_count;
     struct layer_layout {
-        size_t neuron_count;
+        size_t neuron_count; // Units: values per id for embeddings
         initialization_function initialization_function;
         activation_pair activation_pair;
+        layer_type type;
+        size_t vocabulary_size;
     } *layers;
+    activation_backend inference_activations;
 } network_layout;
 
 typedef struct neural_network {
     size_t input_size;
     size_t parameter_count;
+    double *parameters; // Aligned arena holding every layer's biases then weights, in layer order
     const loss_function *loss;
+    activation_backend inference_activations; // Used by network_infer only
+    void *mapping;       // File mapping holding the parameters when loaded by network_load, else NULL
+    size_t mapping_size;
     size_t layer_count;
     layer *layers[];
 } neural_network;
 
+size_t network_parameter_count(const network_layout *layout);
+
 neural_network* network_create(network_layout *layout);
+// Same, reading and writing the parameters in place in a file mapping, which network_free unmaps.
+neural_network* network_create_mapped(network_layout *layout, void *mapping, size_t mapping_size, double *parameters);
 
 void network_free(neural_network *network);
 
-neural_network* network_initialize(neural_network *network);
+neural_network* network_initialize(neural_network *network, uint64_t seed);
 
-void network_infer(neural_network *network, double *input, double *output);
+// Inference only reads the network, so any number of threads may run it on the same network
+// at once, each with its own context: a batch_arena of one sample, which holds every buffer
+// the forward pass writes. Release contexts with batch_arena_free.
+batch_arena* network_inference_context_create(const neural_network *network);
+void network_infer(const neural_network *network, batch_arena *context, const double *input, double *output);
 
 typedef struct training_parameters {
     dataset train_dataset;
     dataset test_dataset;
     size_t epoch_count;
-    size_t batch_size;
+    size_t batch_size;         // Samples per micro-batch, all resident at once
+    size_t accumulation_steps; // Micro-batches summed into each optimizer step
+    bool huge_pages;           // Map the batch buffers on transparent huge pages
+    size_t checkpoint_every;   // Keep the activations of every k-th layer only, recomputing the others
+    bool sparse_input;         // Run the first layer on the nonzero inputs of the samples that have few
+    const char *state_path;    // Training state file, see training_state.h
+    size_t state_interval;     // Optimizer steps between two saved states, 0 to never save
+    bool resume_state;         // Start from the state in state_path
     FILE *loss_output;
     FILE *final_output;
 } training_parameters;
 
-void network_train(neural_network *network, adamw *optimizer, training_parameters *options);
+// Returns true on failure, after printing the reason.
+int network_train(neural_network *network, optimizer *optimizer, training_parameters *options);
 
 #endif // NETWORK_H
\ No newline at end of file
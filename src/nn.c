@@ -0,0 +1,136 @@
+#include "nn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "network.h"
+#include "layer.h"
+#include "batch_buffer.h"
+#include "model_file.h"
+
+struct nn_model {
+    neural_network *network;
+};
+
+struct nn_context {
+    const neural_network *network;
+    size_t max_batch_size;
+    batch_arena *arena;
+    const double *inputs[];
+};
+
+const char* nn_status_string(nn_status status)
+{
+    switch (status)
+    {
+    case NN_OK: return "success";
+    case NN_ERROR_IO: return "can't read the model file";
+    case NN_ERROR_FORMAT: return "invalid model file";
+    case NN_ERROR_OUT_OF_MEMORY: return "out of memory";
+    case NN_ERROR_ARGUMENT: return "invalid argument";
+    default: return "unknown error";
+    }
+}
+
+nn_status nn_model_load(const char *path, nn_model **model)
+{
+    if (!path || !model)
+        return NN_ERROR_ARGUMENT;
+    *model = malloc(sizeof(nn_model));
+    if (!*model)
+        return NN_ERROR_OUT_OF_MEMORY;
+
+    const char *reason;
+    switch (network_map(path, &(*model)->network, &reason))
+    {
+    case MODEL_FILE_OK:
+        return NN_OK;
+    case MODEL_FILE_UNREADABLE:
+        free(*model);
+        *model = NULL;
+        return NN_ERROR_IO;
+    case MODEL_FILE_INVALID:
+        free(*model);
+        *model = NULL;
+        return NN_ERROR_FORMAT;
+    default:
+        free(*model);
+        *model = NULL;
+        return NN_ERROR_OUT_OF_MEMORY;
+    }
+}
+
+void nn_model_free(nn_model *model)
+{
+    if (!model)
+        return;
+    network_free(model->network);
+    free(model);
+}
+
+size_t nn_model_input_size(const nn_model *model)
+{
+    return model->network->input_size;
+}
+
+size_t nn_model_output_size(const nn_model *model)
+{
+    return model->network->layers[model->network->layer_count - 1]->output_size;
+}
+
+nn_status nn_context_create(const nn_model *model, size_t max_batch_size, nn_context **context)
+{
+    if (!model || !context || !max_batch_size)
+        return NN_ERROR_ARGUMENT;
+    *context = malloc(sizeof(nn_context) + max_batch_size * sizeof(const double*));
+    if (!*context)
+        return NN_ERROR_OUT_OF_MEMORY;
+
+    **context = (nn_context) {
+        .network = model->network,
+        .max_batch_size = max_batch_size,
+        .arena = batch_arena_create(model->network, max_batch_size, false, 1, INPUT_FORMAT_GATHERED)
+    };
+    if (!(*context)->arena)
+    {
+        free(*context);
+        *context = NULL;
+        return NN_ERROR_OUT_OF_MEMORY;
+    }
+    return NN_OK;
+}
+
+void nn_context_free(nn_context *context)
+{
+    if (!context)
+        return;
+    batch_arena_free(context->arena);
+    free(context);
+}
+
+nn_status nn_infer(nn_context *context, const double *input, double *output)
+{
+    return nn_infer_batch(context, 1, input, output);
+}
+
+nn_status nn_infer_batch(nn_context *context, size_t count, const double *inputs, double *outputs)
+{
+    if (!context || ((!inputs || !outputs) && count))
+        return NN_ERROR_ARGUMENT;
+
+    const neural_network *network = context->network;
+    size_t output_layer_idx = network->layer_count - 1;
+    size_t output_size = network->layers[output_layer_idx]->output_size;
+    for (size_t first = 0; first < count; first += context->max_batch_size)
+    {
+        size_t batch_size = count - first < context->max_batch_size ? count - first : context->max_batch_size;
+        for (size_t sample_idx = 0; sample_idx < batch_size; ++sample_idx)
+            context->inputs[sample_idx] = inputs + (first + sample_idx) * network->input_size;
+        batch_arena_infer(context->arena, batch_size, context->inputs);
+        for (size_t sample_idx = 0; sample_idx < batch_size; ++sample_idx)
+            memcpy(outputs + (first + sample_idx) * output_size,
+                context->arena->samples[sample_idx]->layers[output_layer_idx]->activations,
+                output_size * sizeof(double));
+    }
+    return NN_OK;
+}
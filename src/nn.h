@@ -0,0 +1,50 @@
+#ifndef NN_H
+#define NN_H
+
+// Stable C API of libnn, for running saved models in-process.
+//
+// Functions return a status instead of printing or exiting. A model is immutable once
+// loaded: any number of threads may use it at once, each through its own context.
+// A context holds the buffers of the forward pass and must not be used by two threads at
+// the same time. Contexts must be freed before their model.
+
+#include <stddef.h>
+
+#define NN_API_VERSION 1
+
+#if defined(__GNUC__)
+    #define NN_API __attribute__((visibility("default")))
+#else
+    #define NN_API
+#endif
+
+typedef struct nn_model nn_model;
+typedef struct nn_context nn_context;
+
+typedef enum nn_status {
+    NN_OK = 0,
+    NN_ERROR_IO,           // The model file can't be opened or mapped
+    NN_ERROR_FORMAT,       // Not a model file this version of the library can load
+    NN_ERROR_OUT_OF_MEMORY,
+    NN_ERROR_ARGUMENT      // NULL or zero where it isn't allowed
+} nn_status;
+
+NN_API const char* nn_status_string(nn_status status);
+
+// Maps a file written by network_save, see model_file.h; the file is not copied.
+NN_API nn_status nn_model_load(const char *path, nn_model **model);
+NN_API void nn_model_free(nn_model *model);
+NN_API size_t nn_model_input_size(const nn_model *model);
+NN_API size_t nn_model_output_size(const nn_model *model);
+
+// A context for batches of up to max_batch_size inputs.
+NN_API nn_status nn_context_create(const nn_model *model, size_t max_batch_size, nn_context **context);
+NN_API void nn_context_free(nn_context *context);
+
+// output receives nn_model_output_size values. The inputs of a model starting with an
+// embedding are its ids; inputs that aren't ids of its vocabulary share a row for unknown ids.
+NN_API nn_status nn_infer(nn_context *context, const double *input, double *output);
+// Rows of inputs and outputs are contiguous; batches larger than the context's are split.
+NN_API nn_status nn_infer_batch(nn_context *context, size_t count, const double *inputs, double *outputs);
+
+#endif // NN_H
@@ -0,0 +1,260 @@
+#include "optimizer.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "batch_buffer.h"
+#include "network.h"
+#include "layer.h"
+#include "constants.h"
+
+// aligned_alloc requires a nonzero size that is a multiple of the alignment.
+static size_t allocation_size(size_t bytes)
+{
+    return bytes ? ALIGN_SIZE(bytes) : MEMORY_ALIGNMENT;
+}
+
+bool optimizer_init(optimizer *optimizer, const optimizer_type *type, size_t size, size_t state_size)
+{
+    *optimizer = (struct optimizer) {
+        .type = type,
+        .size = size,
+        .t = 0,
+        .state_size = state_size
+    };
+
+    optimizer->gradient = aligned_alloc(MEMORY_ALIGNMENT, allocation_size(size * sizeof(double)));
+    optimizer->state = aligned_alloc(MEMORY_ALIGNMENT, allocation_size(state_size));
+    if (!optimizer->gradient || !optimizer->state)
+    {
+        optimizer_release(optimizer);
+        return true;
+    }
+
+    memset(optimizer->gradient, 0, size * sizeof(double));
+    memset(optimizer->state, 0, state_size);
+    return false;
+}
+
+size_t optimizer_slice_count(const layer *first_layer)
+{
+    return first_layer->type == LAYER_EMBEDDING ? first_layer->weight_rows : first_layer->weight_columns;
+}
+
+bool optimizer_track_slices(optimizer *optimizer, const layer *first_layer)
+{
+    size_t slice_count = optimizer_slice_count(first_layer);
+    optimizer->touched_slices = malloc(slice_count * sizeof(uint32_t));
+    optimizer->slice_marks = calloc(slice_count, 1);
+    if (!optimizer->touched_slices || !optimizer->slice_marks)
+    {
+        free(optimizer->touched_slices);
+        free(optimizer->slice_marks);
+        optimizer->touched_slices = NULL;
+        optimizer->slice_marks = NULL;
+        return true;
+    }
+
+    // A dense layer's inputs are its weight columns, an embedding's ids its table rows.
+    bool rows = first_layer->type == LAYER_EMBEDDING;
+    optimizer->weights_offset = first_layer->output_size;
+    optimizer->slice_count = slice_count;
+    optimizer->slice_length = rows ? first_layer->weight_columns : first_layer->weight_rows;
+    optimizer->slice_stride = rows ? first_layer->weight_columns : 1;
+    optimizer->element_stride = rows ? 1 : first_layer->weight_columns;
+    return false;
+}
+
+void optimizer_release(optimizer *optimizer)
+{
+    free(optimizer->gradient);
+    free(optimizer->state);
+    free(optimizer->touched_slices);
+    free(optimizer->slice_marks);
+}
+
+void optimizer_free(optimizer *optimizer)
+{
+    optimizer->type->free(optimizer);
+}
+
+double optimizer_bytes_per_parameter(const optimizer *optimizer)
+{
+    if (!optimizer->size)
+        return 0;
+    return (double)(optimizer->size * sizeof(double) + optimizer->state_size) / optimizer->size;
+}
+
+void optimizer_update_params(optimizer *optimizer, neural_network *network)
+{
+    optimizer->t++;
+    optimizer->type->update_params(optimizer, network);
+}
+
+void optimizer_synchronize(optimizer *optimizer, neural_network *network)
+{
+    if (optimizer->type->synchronize)
+        optimizer->type->synchronize(optimizer, network);
+}
+
+void optimizer_zero_gradient(optimizer *optimizer)
+{
+    if (!optimizer->slice_count || optimizer->touched_all)
+        memset(optimizer->gradient, 0, optimizer->size * sizeof(double));
+    else
+    {
+        // Of the first layer's weights, only the touched slices can be nonzero.
+        size_t weights_end = optimizer->weights_offset + optimizer->slice_count * optimizer->slice_length;
+        memset(optimizer->gradient, 0, optimizer->weights_offset * sizeof(double));
+        memset(optimizer->gradient + weights_end, 0, (optimizer->size - weights_end) * sizeof(double));
+        for (size_t slice_idx = 0; slice_idx < optimizer->touched_count; ++slice_idx)
+            for (size_t element = 0; element < optimizer->slice_length; ++element)
+                optimizer->gradient[optimizer_slice_index(optimizer, optimizer->touched_slices[slice_idx], element)] = 0;
+    }
+
+    for (size_t slice_idx = 0; slice_idx < optimizer->touched_count; ++slice_idx)
+        optimizer->slice_marks[optimizer->touched_slices[slice_idx]] = 0;
+    optimizer->touched_count = 0;
+    optimizer->touched_all = false;
+}
+
+// Adds slices to those the merges of the current step touched, with sparse updates.
+static void touch_slices(optimizer *optimizer, const uint32_t *slices, size_t slice_count)
+{
+    if (!optimizer->slice_count)
+        return;
+    for (size_t slice_idx = 0; slice_idx < slice_count; ++slice_idx)
+    {
+        uint32_t slice = slices[slice_idx];
+        if (!optimizer->slice_marks[slice])
+        {
+            optimizer->slice_marks[slice] = 1;
+            optimizer->touched_slices[optimizer->touched_count++] = slice;
+        }
+    }
+}
+
+// First layer of a minibatch whose inputs were all gathered as sparse lists: only the columns of
+// the weight gradient where some sample has a nonzero input change. Each sum still accumulates
+// in sample order: the terms left out are zeros.
+static bool merge_sparse_weights(optimizer *optimizer, const batch_arena *arena, const layer *this_layer, double *gradient)
+{
+    uint32_t *columns = arena->sparse_columns;
+    uint8_t *marks = arena->sparse_marks;
+    double *sums = arena->reduction_row;
+    if (!columns)
+        return false;
+    for (size_t sample_idx = 0; sample_idx < arena->sample_count; ++sample_idx)
+        if (arena->samples[sample_idx]->layers[0]->sparse_count == SPARSE_INPUT_DENSE)
+            return false;
+
+    // The union of the nonzero columns, whose sums start at zero.
+    size_t input_size = this_layer->input_size;
+    size_t column_count = 0;
+    for (size_t sample_idx = 0; sample_idx < arena->sample_count; ++sample_idx)
+    {
+        const struct batch_buffer_layer_data *layer_buffer = arena->samples[sample_idx]->layers[0];
+        for (size_t nonzero = 0; nonzero < layer_buffer->sparse_count; ++nonzero)
+        {
+            uint32_t column = layer_buffer->sparse_indices[nonzero];
+            if (!marks[column])
+            {
+                marks[column] = 1;
+                sums[column] = 0;
+                columns[column_count++] = column;
+            }
+        }
+    }
+    for (size_t column_idx = 0; column_idx < column_count; ++column_idx)
+        marks[columns[column_idx]] = 0;
+    touch_slices(optimizer, columns, column_count);
+
+    for (size_t neuron = 0; neuron < this_layer->output_size; ++neuron, gradient += input_size)
+    {
+        for (size_t sample_idx = 0; sample_idx < arena->sample_count; ++sample_idx)
+        {
+            const struct batch_buffer_layer_data *layer_buffer = arena->samples[sample_idx]->layers[0];
+            double local_gradient = layer_buffer->local_gradients[neuron];
+            if (local_gradient == 0)
+                continue;
+            for (size_t nonzero = 0; nonzero < layer_buffer->sparse_count; ++nonzero)
+                sums[layer_buffer->sparse_indices[nonzero]] += local_gradient * layer_buffer->sparse_values[nonzero];
+        }
+        for (size_t column_idx = 0; column_idx < column_count; ++column_idx)
+        {
+            uint32_t column = columns[column_idx];
+            gradient[column] += sums[column];
+            sums[column] = 0;
+        }
+    }
+    return true;
+}
+
+// Embedding layers: the local gradients of each input are added to the table row its id
+// read, sample after sample. Only those rows change.
+static void merge_embedding(optimizer *optimizer, const batch_arena *arena, const layer *this_layer, size_t layer_idx, double *gradient)
+{
+    size_t units = this_layer->weight_columns;
+    for (size_t sample_idx = 0; sample_idx < arena->sample_count; ++sample_idx)
+    {
+        const struct batch_buffer_layer_data *layer_buffer = arena->samples[sample_idx]->layers[layer_idx];
+        for (size_t field = 0; field < this_layer->input_size; ++field)
+        {
+            uint32_t row = (uint32_t)layer_embedding_row(this_layer->vocabulary_size, layer_buffer->input[field]);
+            double *gradient_row = gradient + units * row;
+            const double *local_gradients = layer_buffer->local_gradients + units * field;
+            #pragma omp simd
+            for (size_t unit = 0; unit < units; ++unit)
+                gradient_row[unit] += local_gradients[unit];
+            touch_slices(optimizer, &row, 1);
+        }
+    }
+}
+
+void optimizer_merge_layer(optimizer *optimizer, const neural_network *network, const batch_arena *arena, size_t layer_idx)
+{
+    const layer *this_layer = network->layers[layer_idx];
+    double *gradient = optimizer->gradient + (this_layer->biases - network->parameters);
+    double *sums = arena->reduction_row;
+    size_t input_size = this_layer->input_size;
+
+    // Samples are summed into a row first, then added to the gradient, so that each sum
+    // accumulates in sample order. The rows of each sample are read contiguously.
+    for (size_t bias_idx = 0; bias_idx < this_layer->output_size; ++bias_idx)
+    {
+        double sum = 0;
+        for (size_t sample_idx = 0; sample_idx < arena->sample_count; ++sample_idx)
+            sum += arena->samples[sample_idx]->layers[layer_idx]->local_gradients[bias_idx];
+        gradient[bias_idx] += sum;
+    }
+    gradient += this_layer->output_size;
+
+    if (this_layer->type == LAYER_EMBEDDING)
+    {
+        merge_embedding(optimizer, arena, this_layer, layer_idx, gradient);
+        return;
+    }
+    if (layer_idx == 0 && merge_sparse_weights(optimizer, arena, this_layer, gradient))
+        return;
+    if (layer_idx == 0)
+        optimizer->touched_all = true;
+
+    for (size_t neuron = 0; neuron < this_layer->output_size; ++neuron, gradient += input_size)
+    {
+        for (size_t input_idx = 0; input_idx < input_size; ++input_idx)
+            sums[input_idx] = 0;
+        for (size_t sample_idx = 0; sample_idx < arena->sample_count; ++sample_idx)
+        {
+            const struct batch_buffer_layer_data *layer_buffer = arena->samples[sample_idx]->layers[layer_idx];
+            double local_gradient = layer_buffer->local_gradients[neuron];
+            const double *input = layer_buffer->input;
+            #pragma omp simd
+            for (size_t input_idx = 0; input_idx < input_size; ++input_idx)
+                sums[input_idx] += local_gradient * input[input_idx];
+        }
+        #pragma omp simd
+        for (size_t input_idx = 0; input_idx < input_size; ++input_idx)
+            gradient[input_idx] += sums[input_idx];
+    }
+}
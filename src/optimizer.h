@@ -0,0 +1,71 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct neural_network neural_network;
+typedef struct batch_arena batch_arena;
+typedef struct layer layer;
+typedef struct optimizer optimizer;
+
+// Spans shorter than this are updated by the calling thread only.
+#define OPTIMIZER_PARALLEL_THRESHOLD 16384
+
+typedef struct optimizer_type {
+    const char *name;
+    void (*update_params)(optimizer *optimizer, neural_network *network);
+    void (*free)(optimizer *optimizer);
+    void (*synchronize)(optimizer *optimizer, neural_network *network); // Optional
+} optimizer_type;
+
+// Common part of every optimizer, embedded as the first member of each implementation.
+typedef struct optimizer {
+    const optimizer_type *type;
+    size_t size;          // Number of parameters
+    unsigned long t;      // Time step counter
+    double *gradient;     // Batch gradient, laid out like the network's parameter arena
+    size_t state_size;    // Size in bytes of the aligned block holding the optimizer's own state
+    void *state;
+
+    // With sparse updates, see optimizer_track_slices: the first layer's weights seen as
+    // slice_count slices of slice_length values, the columns of a dense layer or the rows of an
+    // embedding's table. The merges since the gradient was cleared touched the listed slices,
+    // each listed once, or all of them with touched_all; the gradient is zero in the others.
+    size_t weights_offset;               // Index of the first weight in the parameters
+    size_t slice_count, slice_length;
+    size_t slice_stride, element_stride; // Distances between two slices, and two values of one
+    uint32_t *touched_slices;
+    uint8_t *slice_marks;
+    size_t touched_count;
+    bool touched_all;
+} optimizer;
+
+// Allocates the gradient and a zeroed state block of state_size bytes; true on failure.
+bool optimizer_init(optimizer *optimizer, const optimizer_type *type, size_t size, size_t state_size);
+// Keeps track of the slices of the first layer's weights that each step's gradient touches; true on failure.
+bool optimizer_track_slices(optimizer *optimizer, const layer *first_layer);
+size_t optimizer_slice_count(const layer *first_layer);
+void optimizer_release(optimizer *optimizer);
+
+// Index in the parameters of a value of a tracked slice.
+static inline size_t optimizer_slice_index(const optimizer *optimizer, size_t slice, size_t element)
+{
+    return optimizer->weights_offset + slice * optimizer->slice_stride + element * optimizer->element_stride;
+}
+
+void optimizer_free(optimizer *optimizer);
+
+// Bytes of gradient and state kept per parameter, 0 without parameters.
+double optimizer_bytes_per_parameter(const optimizer *optimizer);
+
+// Batch gradients are summed into optimizer->gradient, which is cleared by optimizer_zero_gradient.
+// Layers are merged one at a time, as soon as backpropagation has computed their local gradients.
+void optimizer_zero_gradient(optimizer *optimizer);
+void optimizer_merge_layer(optimizer *optimizer, const neural_network *network, const batch_arena *arena, size_t layer_idx);
+void optimizer_update_params(optimizer *optimizer, neural_network *network);
+// Applies the updates an optimizer deferred, for the parameters to be read or saved.
+void optimizer_synchronize(optimizer *optimizer, neural_network *network);
+
+#endif // OPTIMIZER_H
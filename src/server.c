@@ -0,0 +1,498 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "layer.h"
+#include "batch_buffer.h"
+#include "constants.h"
+
+typedef struct connection {
+    int fd;
+    size_t references; // The reading loop's while open, plus one per pending request; under the server lock
+    pthread_mutex_t write_lock;
+    bool broken;       // Set once a reply could not be sent in time, under write_lock
+    size_t received;   // Bytes of the current request frame read so far
+    char frame[];
+} connection;
+
+typedef struct request {
+    struct request *next;
+    connection *connection;
+    uint64_t id;
+    uint64_t arrival_ns;
+    double input[];
+} request;
+
+typedef struct server {
+    const neural_network *network;
+    const server_options *options;
+    size_t input_size, output_size;
+    size_t frame_size, reply_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    request *head, *tail;
+    size_t queued_count;
+    bool stopping;
+
+    uint64_t request_count, batch_count;
+    uint64_t total_queue_ns, max_queue_ns;
+    uint64_t total_compute_ns, max_compute_ns;
+} server;
+
+typedef struct worker {
+    server *server;
+    pthread_t thread;
+    batch_arena *arena;
+    request **batch;
+    const double **inputs;
+    char *reply;
+} worker;
+
+// Slots of the poll table before the connections.
+enum { LISTEN_SLOT, WAKE_SLOT, CONNECTION_SLOTS };
+
+static volatile sig_atomic_t stop_requested = 0;
+static int wake_fd = -1; // Write end of the pipe that wakes the polling thread up
+
+static void request_stop(int signal_number)
+{
+    (void)signal_number;
+    stop_requested = 1;
+    int saved_errno = errno;
+    if (write(wake_fd, "", 1) < 0) {} // A full pipe already wakes the polling thread
+    errno = saved_errno;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Drops a reference to a connection under the server lock, closing it after the last one.
+static void release_connection(connection *connection)
+{
+    if (--connection->references == 0)
+    {
+        close(connection->fd);
+        pthread_mutex_destroy(&connection->write_lock);
+        free(connection);
+    }
+}
+
+static bool send_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Takes the next micro-batch from the queue, under the server lock; returns 0 once stopping with an empty queue.
+static size_t take_batch(server *server, request **batch)
+{
+    size_t max_batch_size = server->options->max_batch_size;
+    for (;;)
+    {
+        while (!server->head && !server->stopping)
+            pthread_cond_wait(&server->queued, &server->lock);
+        if (!server->head)
+            return 0;
+
+        // Wait for a full batch, at most until the oldest request has waited long enough.
+        uint64_t deadline = server->head->arrival_ns + server->options->max_delay_us * 1000;
+        struct timespec deadline_time = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+        while (server->head && server->queued_count < max_batch_size && !server->stopping && now_ns() < deadline)
+            pthread_cond_timedwait(&server->queued, &server->lock, &deadline_time);
+
+        // Another worker may have taken the requests meanwhile.
+        if (!server->head)
+            continue;
+
+        size_t count = 0;
+        while (server->head && count < max_batch_size)
+        {
+            batch[count++] = server->head;
+            server->head = server->head->next;
+        }
+        if (!server->head)
+            server->tail = NULL;
+        server->queued_count -= count;
+
+        // Leave the rest of the queue to the next free worker.
+        if (server->head)
+            pthread_cond_signal(&server->queued);
+        return count;
+    }
+}
+
+static void* worker_thread(void *argument)
+{
+    worker *worker = argument;
+    server *server = worker->server;
+    size_t output_layer_idx = server->network->layer_count - 1;
+
+    pthread_mutex_lock(&server->lock);
+    size_t count;
+    while ((count = take_batch(server, worker->batch)) > 0)
+    {
+        pthread_mutex_unlock(&server->lock);
+
+        uint64_t start_ns = now_ns();
+        for (size_t request_idx = 0; request_idx < count; ++request_idx)
+            worker->inputs[request_idx] = worker->batch[request_idx]->input;
+        batch_arena_infer(worker->arena, count, worker->inputs);
+        uint64_t compute_ns = now_ns() - start_ns;
+
+        uint64_t total_queue_ns = 0, max_queue_ns = 0;
+        for (size_t request_idx = 0; request_idx < count; ++request_idx)
+        {
+            request *request = worker->batch[request_idx];
+            uint64_t queue_ns = start_ns - request->arrival_ns;
+            total_queue_ns += queue_ns;
+            max_queue_ns = queue_ns > max_queue_ns ? queue_ns : max_queue_ns;
+
+            uint64_t header[3] = { request->id, queue_ns, compute_ns };
+            memcpy(worker->reply, header, sizeof(header));
+            memcpy(worker->reply + sizeof(header), worker->arena->samples[request_idx]->layers[output_layer_idx]->activations, server->output_size * sizeof(double));
+
+            // A client that is gone, or doesn't read its replies, is disconnected: the polling
+            // thread then reads the end of the connection and releases it.
+            connection *connection = request->connection;
+            pthread_mutex_lock(&connection->write_lock);
+            if (!connection->broken && !send_all(connection->fd, worker->reply, server->reply_size))
+            {
+                connection->broken = true;
+                shutdown(connection->fd, SHUT_RDWR);
+            }
+            pthread_mutex_unlock(&connection->write_lock);
+        }
+
+        pthread_mutex_lock(&server->lock);
+        server->request_count += count;
+        server->batch_count++;
+        server->total_queue_ns += total_queue_ns;
+        server->max_queue_ns = max_queue_ns > server->max_queue_ns ? max_queue_ns : server->max_queue_ns;
+        server->total_compute_ns += compute_ns * count;
+        server->max_compute_ns = compute_ns > server->max_compute_ns ? compute_ns : server->max_compute_ns;
+        for (size_t request_idx = 0; request_idx < count; ++request_idx)
+        {
+            release_connection(worker->batch[request_idx]->connection);
+            free(worker->batch[request_idx]);
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+// Reads whatever the client has sent, queueing every complete request.
+// Returns false once the connection is closed or broken.
+static bool read_requests(server *server, connection *connection)
+{
+    for (;;)
+    {
+        ssize_t received = recv(connection->fd, connection->frame + connection->received, server->frame_size - connection->received, MSG_DONTWAIT);
+        if (received < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (received == 0)
+            return false;
+
+        connection->received += received;
+        if (connection->received < server->frame_size)
+            continue;
+        connection->received = 0;
+
+        request *new_request = malloc(sizeof(request) + server->input_size * sizeof(double));
+        if (!new_request)
+            return false;
+        new_request->next = NULL;
+        new_request->connection = connection;
+        memcpy(&new_request->id, connection->frame, sizeof(uint64_t));
+        memcpy(new_request->input, connection->frame + sizeof(uint64_t), server->input_size * sizeof(double));
+        new_request->arrival_ns = now_ns();
+
+        pthread_mutex_lock(&server->lock);
+        connection->references++;
+        if (server->tail)
+            server->tail->next = new_request;
+        else
+            server->head = new_request;
+        server->tail = new_request;
+        server->queued_count++;
+        pthread_cond_signal(&server->queued);
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+static connection* accept_connection(server *server, int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return NULL;
+
+    // Sending blocks with the connection's write lock held, so it must not block for long.
+    struct timeval send_timeout = { .tv_sec = SERVER_SEND_TIMEOUT_MS / 1000, .tv_usec = SERVER_SEND_TIMEOUT_MS % 1000 * 1000 };
+    uint64_t hello[3] = { 0, server->input_size, server->output_size };
+    memcpy(hello, SERVER_MAGIC, sizeof(SERVER_MAGIC));
+    connection *new_connection = malloc(sizeof(connection) + server->frame_size);
+    if (!new_connection || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout))
+        || !send_all(fd, (const char*)hello, sizeof(hello)))
+    {
+        free(new_connection);
+        close(fd);
+        return NULL;
+    }
+
+    new_connection->fd = fd;
+    new_connection->references = 1;
+    new_connection->received = 0;
+    new_connection->broken = false;
+    pthread_mutex_init(&new_connection->write_lock, NULL);
+    return new_connection;
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // Replace a socket left behind by a previous server, but nothing else.
+    struct stat status;
+    if (!stat(path, &status) && S_ISSOCK(status.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) || listen(fd, SOMAXCONN))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't listen on '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Polls the listening socket and every connection until a stop is requested; the stop signals
+// write to the wake pipe, so that one arriving just before poll still interrupts it.
+static void serve_connections(server *server, int listen_fd, int wake_read_fd)
+{
+    size_t capacity = 16, count = 0;
+    struct pollfd *fds = malloc((capacity + CONNECTION_SLOTS) * sizeof(struct pollfd));
+    connection **connections = malloc(capacity * sizeof(connection*));
+    if (!fds || !connections)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to allocate the connection table\n");
+        free(fds);
+        free(connections);
+        return;
+    }
+    fds[LISTEN_SLOT] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+    fds[WAKE_SLOT] = (struct pollfd) { .fd = wake_read_fd, .events = POLLIN };
+
+    while (!stop_requested)
+    {
+        if (poll(fds, count + CONNECTION_SLOTS, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, PROGRAM_NAME": error: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // Connections are removed by moving the last one into their slot.
+        for (size_t connection_idx = count; connection_idx-- > 0;)
+        {
+            if (!fds[connection_idx + CONNECTION_SLOTS].revents || read_requests(server, connections[connection_idx]))
+                continue;
+            pthread_mutex_lock(&server->lock);
+            release_connection(connections[connection_idx]);
+            pthread_mutex_unlock(&server->lock);
+            connections[connection_idx] = connections[--count];
+            fds[connection_idx + CONNECTION_SLOTS] = fds[count + CONNECTION_SLOTS];
+        }
+
+        if (fds[LISTEN_SLOT].revents & POLLIN)
+        {
+            if (count == capacity)
+            {
+                struct pollfd *new_fds = realloc(fds, (2 * capacity + CONNECTION_SLOTS) * sizeof(struct pollfd));
+                if (new_fds)
+                    fds = new_fds;
+                connection **new_connections = realloc(connections, 2 * capacity * sizeof(connection*));
+                if (new_connections)
+                    connections = new_connections;
+                if (new_fds && new_connections)
+                    capacity *= 2;
+            }
+            connection *new_connection = count < capacity ? accept_connection(server, listen_fd) : NULL;
+            if (new_connection)
+            {
+                fds[count + CONNECTION_SLOTS] = (struct pollfd) { .fd = new_connection->fd, .events = POLLIN };
+                connections[count++] = new_connection;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&server->lock);
+    for (size_t connection_idx = 0; connection_idx < count; ++connection_idx)
+        release_connection(connections[connection_idx]);
+    pthread_mutex_unlock(&server->lock);
+    free(fds);
+    free(connections);
+}
+
+static void free_workers(worker *workers, size_t count)
+{
+    for (size_t worker_idx = 0; worker_idx < count; ++worker_idx)
+    {
+        if (workers[worker_idx].arena)
+            batch_arena_free(workers[worker_idx].arena);
+        free(workers[worker_idx].batch);
+        free(workers[worker_idx].inputs);
+        free(workers[worker_idx].reply);
+    }
+    free(workers);
+}
+
+int server_run(const neural_network *network, const server_options *options)
+{
+    server server = {
+        .network = network,
+        .options = options,
+        .input_size = network->input_size,
+        .output_size = network->layers[network->layer_count - 1]->output_size,
+        .frame_size = sizeof(uint64_t) + network->input_size * sizeof(double),
+        .reply_size = 3 * sizeof(uint64_t) + network->layers[network->layer_count - 1]->output_size * sizeof(double)
+    };
+
+    worker *workers = calloc(options->worker_count, sizeof(worker));
+    bool allocated = workers != NULL;
+    for (size_t worker_idx = 0; allocated && worker_idx < options->worker_count; ++worker_idx)
+    {
+        worker *worker = &workers[worker_idx];
+        worker->server = &server;
+        worker->arena = batch_arena_create(network, options->max_batch_size, false, 1, INPUT_FORMAT_GATHERED);
+        worker->batch = malloc(options->max_batch_size * sizeof(request*));
+        worker->inputs = malloc(options->max_batch_size * sizeof(double*));
+        worker->reply = malloc(server.reply_size);
+        allocated = worker->arena && worker->batch && worker->inputs && worker->reply;
+    }
+    if (!allocated)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to allocate the workers\n");
+        free_workers(workers, workers ? options->worker_count : 0);
+        return true;
+    }
+
+    int wake_pipe[2] = { -1, -1 };
+    if (pipe(wake_pipe) || fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't create the wake pipe: %s\n", strerror(errno));
+        if (wake_pipe[0] >= 0)
+        {
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+        }
+        free_workers(workers, options->worker_count);
+        return true;
+    }
+    wake_fd = wake_pipe[1];
+
+    int listen_fd = open_socket(options->socket_path);
+    if (listen_fd < 0)
+    {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        free_workers(workers, options->worker_count);
+        return true;
+    }
+
+    pthread_condattr_t condition_attributes;
+    pthread_condattr_init(&condition_attributes);
+    pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&server.queued, &condition_attributes);
+    pthread_condattr_destroy(&condition_attributes);
+    pthread_mutex_init(&server.lock, NULL);
+
+    // Only the polling thread handles the stop signals, so that they interrupt poll.
+    struct sigaction action = { .sa_handler = request_stop };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t stop_signals, previous_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous_mask);
+
+    size_t started = 0;
+    while (started < options->worker_count && !pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]))
+        started++;
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+    if (started == options->worker_count)
+    {
+        printf("Serving on '%s' with %zu workers, batches of up to %zu requests within %llu us\n",
+            options->socket_path, options->worker_count, options->max_batch_size, (unsigned long long)options->max_delay_us);
+        fflush(stdout);
+        serve_connections(&server, listen_fd, wake_pipe[0]);
+    }
+    else
+        fprintf(stderr, PROGRAM_NAME": error: failed to start the workers\n");
+
+    // Workers answer the requests already queued before stopping.
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.queued);
+    pthread_mutex_unlock(&server.lock);
+    for (size_t worker_idx = 0; worker_idx < started; ++worker_idx)
+        pthread_join(workers[worker_idx].thread, NULL);
+
+    close(listen_fd);
+    unlink(options->socket_path);
+    wake_fd = -1;
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    pthread_cond_destroy(&server.queued);
+    pthread_mutex_destroy(&server.lock);
+    free_workers(workers, options->worker_count);
+
+    if (server.request_count > 0)
+    {
+        printf("Served %llu requests in %llu batches, %.1f per batch\n",
+            (unsigned long long)server.request_count, (unsigned long long)server.batch_count, (double)server.request_count / server.batch_count);
+        printf("Queue latency: mean %.1f us, max %.1f us\n",
+            server.total_queue_ns / 1e3 / server.request_count, server.max_queue_ns / 1e3);
+        printf("Compute latency: mean %.1f us, max %.1f us\n",
+            server.total_compute_ns / 1e3 / server.request_count, server.max_compute_ns / 1e3);
+    }
+    return started != options->worker_count;
+}
@@ -0,0 +1,39 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "network.h"
+
+// Local inference server: clients connect to a Unix domain stream socket and send requests,
+// which are coalesced into micro-batches of at most max_batch_size requests. A batch starts
+// when it is full, or when its oldest request has waited max_delay_us, on the first free
+// worker thread.
+//
+// Protocol, in host byte order:
+//   on connection, the server sends  char magic[8] = "NNSERVE", uint64_t input_size, uint64_t output_size
+//   each request is                  uint64_t id, double input[input_size]
+//   each reply is                    uint64_t id, uint64_t queue_ns, uint64_t compute_ns, double output[output_size]
+// Replies of a connection may come out of order when there are several workers. A client that
+// leaves a reply unread for SERVER_SEND_TIMEOUT_MS is disconnected.
+// queue_ns is the time between the request being read and its batch starting, compute_ns
+// the time spent on the batch.
+
+#define SERVER_MAGIC "NNSERVE"
+#define SERVER_MAX_BATCH_SIZE 32
+#define SERVER_MAX_DELAY_US 200
+#define SERVER_SEND_TIMEOUT_MS 1000
+
+typedef struct server_options {
+    const char *socket_path;
+    size_t max_batch_size;
+    uint64_t max_delay_us;
+    size_t worker_count;
+} server_options;
+
+// Serves until SIGINT or SIGTERM, then prints latency statistics.
+// Returns true on failure, after printing the reason.
+int server_run(const neural_network *network, const server_options *options);
+
+#endif // SERVER_H
@@ -0,0 +1,74 @@
+#include "sgd.h"
+
+#include <stdlib.h>
+
+#include "layer.h"
+#include "network.h"
+
+static void sgd_update_params(optimizer *base, neural_network *network);
+static void sgd_free(optimizer *base);
+
+const optimizer_type optimizer_sgd = {
+    .name = "SGD",
+    .update_params = sgd_update_params,
+    .free = sgd_free
+};
+
+optimizer* sgd_create(size_t size, double alpha, double momentum, double weight_decay)
+{
+    sgd *optimizer = malloc(sizeof(sgd));
+    if (!optimizer) return NULL;
+
+    if (optimizer_init(&optimizer->base, &optimizer_sgd, size, size * sizeof(double)))
+    {
+        free(optimizer);
+        return NULL;
+    }
+
+    optimizer->alpha = alpha;
+    optimizer->momentum = momentum;
+    optimizer->weight_decay = weight_decay;
+    optimizer->velocity = optimizer->base.state;
+
+    return &optimizer->base;
+}
+
+static void sgd_free(optimizer *base)
+{
+    optimizer_release(base);
+    free(base);
+}
+
+static void sgd_span(const sgd *optimizer, size_t count, double weight_decay,
+    double *restrict params, double *restrict velocity, const double *restrict g)
+{
+    const double alpha = optimizer->alpha, momentum = optimizer->momentum;
+    #pragma omp parallel for simd schedule(static) if(count >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i)
+    {
+        double v_i = momentum * velocity[i] + g[i];
+        velocity[i] = v_i;
+        params[i] -= alpha * (v_i + weight_decay * params[i]);
+    }
+}
+
+static void sgd_update_params(optimizer *base, neural_network *network)
+{
+    sgd *optimizer = (sgd*)base;
+
+    // Biases are not decayed, weights are.
+    size_t parameter_idx = 0;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        layer *this_layer = network->layers[layer_idx];
+        size_t weight_count = this_layer->weight_rows * this_layer->weight_columns;
+
+        sgd_span(optimizer, this_layer->output_size, 0.0, network->parameters + parameter_idx,
+            optimizer->velocity + parameter_idx, base->gradient + parameter_idx);
+        parameter_idx += this_layer->output_size;
+
+        sgd_span(optimizer, weight_count, optimizer->weight_decay, network->parameters + parameter_idx,
+            optimizer->velocity + parameter_idx, base->gradient + parameter_idx);
+        parameter_idx += weight_count;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef SGD_H
+#define SGD_H
+
+#include <stddef.h>
+
+#include "optimizer.h"
+
+// Stochastic gradient descent with heavy-ball momentum: one state vector.
+typedef struct sgd {
+    optimizer base;
+
+    double alpha;        // Learning rate
+    double momentum;     // Decay rate of the velocity
+    double weight_decay; // Decoupled weight decay parameter
+
+    double *velocity;    // View into base.state
+} sgd;
+
+extern const optimizer_type optimizer_sgd;
+
+optimizer* sgd_create(size_t size, double alpha, double momentum, double weight_decay);
+
+#endif // SGD_H
@@ -0,0 +1,290 @@
+#include "training_state.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "network.h"
+#include "optimizer.h"
+#include "constants.h"
+
+#define TRAINING_STATE_MAGIC "NNSTATE"
+#define TRAINING_STATE_VERSION 2
+#define TRAINING_STATE_BYTE_ORDER 0x01020304u
+#define TRAINING_STATE_NAME_SIZE 16
+
+// Followed by the parameters, the optimizer state block, then the entry order as 64-bit integers.
+typedef struct training_state_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    char optimizer_name[TRAINING_STATE_NAME_SIZE];
+    uint64_t parameter_count;
+    uint64_t state_size;
+    uint64_t entry_count;
+    uint64_t batch_size;
+    uint64_t accumulation_steps;
+    uint64_t epoch_idx;
+    uint64_t entry_idx;
+    uint64_t t;
+    uint64_t epoch_evaluated;
+    double epoch_loss, epoch_accuracy;
+    char random_state[RANDOM_STATE_SIZE];
+} training_state_header;
+
+#define NO_BUFFER -1
+
+struct training_state_writer {
+    char *path;
+    char *temporary_path;
+    size_t size; // Bytes of one snapshot
+    char *buffers[2];
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int writing, pending; // Buffer index, or NO_BUFFER
+    bool stopping;
+};
+
+static training_state_header make_header(const neural_network *network, const optimizer *optimizer, size_t entry_count)
+{
+    training_state_header header = {
+        .magic = TRAINING_STATE_MAGIC,
+        .version = TRAINING_STATE_VERSION,
+        .byte_order = TRAINING_STATE_BYTE_ORDER,
+        .parameter_count = network->parameter_count,
+        .state_size = optimizer->state_size,
+        .entry_count = entry_count
+    };
+    strncpy(header.optimizer_name, optimizer->type->name, sizeof(header.optimizer_name) - 1);
+    return header;
+}
+
+static size_t file_size(const training_state_header *header)
+{
+    return sizeof(*header) + header->parameter_count * sizeof(double) + header->state_size + header->entry_count * sizeof(uint64_t);
+}
+
+// Writes data to the temporary path, syncs it, then renames it over path and syncs the directory.
+static int write_atomically(const char *path, const char *temporary_path, const char *data, size_t size)
+{
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return true;
+
+    bool failed = false;
+    while (size > 0 && !failed)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        failed = written <= 0;
+        data += written;
+        size -= written;
+    }
+    failed = failed || fsync(fd);
+    failed = close(fd) || failed;
+    if (failed || rename(temporary_path, path))
+        return true;
+
+    // The rename itself is only durable once the directory is synced.
+    const char *slash = strrchr(path, '/');
+    char *directory = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    int directory_fd = directory ? open(directory, O_RDONLY | O_DIRECTORY) : -1;
+    free(directory);
+    if (directory_fd >= 0)
+    {
+        fsync(directory_fd);
+        close(directory_fd);
+    }
+    return false;
+}
+
+static void* writer_thread(void *argument)
+{
+    training_state_writer *writer = argument;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;)
+    {
+        while (writer->pending == NO_BUFFER && !writer->stopping)
+            pthread_cond_wait(&writer->wake, &writer->lock);
+        if (writer->pending == NO_BUFFER)
+            break;
+
+        writer->writing = writer->pending;
+        writer->pending = NO_BUFFER;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (write_atomically(writer->path, writer->temporary_path, writer->buffers[writer->writing], writer->size))
+            fprintf(stderr, PROGRAM_NAME": error: failed to write '%s': %s\n", writer->path, strerror(errno));
+
+        pthread_mutex_lock(&writer->lock);
+        writer->writing = NO_BUFFER;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+training_state_writer* training_state_writer_create(const char *path, const neural_network *network, const optimizer *optimizer, size_t entry_count)
+{
+    training_state_writer *writer = malloc(sizeof(training_state_writer));
+    if (!writer) return NULL;
+
+    training_state_header header = make_header(network, optimizer, entry_count);
+    *writer = (training_state_writer) {
+        .path = strdup(path),
+        .temporary_path = malloc(strlen(path) + sizeof(".tmp")),
+        .size = file_size(&header),
+        .writing = NO_BUFFER,
+        .pending = NO_BUFFER
+    };
+    if (writer->temporary_path)
+        sprintf(writer->temporary_path, "%s.tmp", path);
+    writer->buffers[0] = malloc(writer->size);
+    writer->buffers[1] = malloc(writer->size);
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    if (!writer->path || !writer->temporary_path || !writer->buffers[0] || !writer->buffers[1]
+        || pthread_create(&writer->thread, NULL, writer_thread, writer))
+    {
+        pthread_cond_destroy(&writer->wake);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer->path);
+        free(writer->temporary_path);
+        free(writer->buffers[0]);
+        free(writer->buffers[1]);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+void training_state_snapshot(training_state_writer *writer, const neural_network *network, const optimizer *optimizer, const training_position *position)
+{
+    // Take the buffer that is not being written, withdrawing it if it holds an older snapshot.
+    pthread_mutex_lock(&writer->lock);
+    int target = writer->writing == 0 ? 1 : 0;
+    if (writer->pending == target)
+        writer->pending = NO_BUFFER;
+    pthread_mutex_unlock(&writer->lock);
+
+    training_state_header header = make_header(network, optimizer, position->entry_count);
+    header.batch_size = position->batch_size;
+    header.accumulation_steps = position->accumulation_steps;
+    header.epoch_idx = position->epoch_idx;
+    header.entry_idx = position->entry_idx;
+    header.t = optimizer->t;
+    header.epoch_evaluated = position->epoch_evaluated;
+    header.epoch_loss = position->epoch_loss;
+    header.epoch_accuracy = position->epoch_accuracy;
+    memcpy(header.random_state, position->random_state, sizeof(header.random_state));
+
+    char *data = writer->buffers[target];
+    memcpy(data, &header, sizeof(header));
+    data += sizeof(header);
+    memcpy(data, network->parameters, network->parameter_count * sizeof(double));
+    data += network->parameter_count * sizeof(double);
+    memcpy(data, optimizer->state, optimizer->state_size);
+    data += optimizer->state_size;
+    uint64_t *order = (uint64_t*)data;
+    for (size_t entry_idx = 0; entry_idx < position->entry_count; ++entry_idx)
+        order[entry_idx] = position->order[entry_idx];
+
+    pthread_mutex_lock(&writer->lock);
+    writer->pending = target;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void training_state_writer_free(training_state_writer *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_cond_destroy(&writer->wake);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->path);
+    free(writer->temporary_path);
+    free(writer->buffers[0]);
+    free(writer->buffers[1]);
+    free(writer);
+}
+
+int training_state_load(const char *path, neural_network *network, optimizer *optimizer, training_position *position)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't open '%s': %s\n", path, strerror(errno));
+        return true;
+    }
+
+    training_state_header expected = make_header(network, optimizer, position->entry_count);
+    training_state_header header;
+    const char *problem = NULL;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, expected.magic, sizeof(header.magic)))
+        problem = "not a training state file";
+    else if (header.byte_order != expected.byte_order || header.version != expected.version)
+        problem = "unsupported byte order or format version";
+    else if (memcmp(header.optimizer_name, expected.optimizer_name, sizeof(header.optimizer_name))
+        || header.parameter_count != expected.parameter_count || header.state_size != expected.state_size)
+        problem = "saved for another network or optimizer";
+    else if (header.entry_count != expected.entry_count
+        || header.batch_size != position->batch_size || header.accumulation_steps != position->accumulation_steps)
+        problem = "saved for another training set or batch size";
+    else if (header.entry_idx > header.entry_count)
+        problem = "invalid position";
+
+    // The rest of the file is read and checked aside, so that a bad file changes nothing.
+    size_t payload_size = problem ? 0 : file_size(&header) - sizeof(header);
+    char *payload = problem ? NULL : malloc(payload_size);
+    if (!problem && !payload)
+        problem = "out of memory";
+    if (!problem && fread(payload, 1, payload_size, file) != payload_size)
+        problem = "truncated file";
+    fclose(file);
+
+    if (problem)
+    {
+        free(payload);
+        fprintf(stderr, PROGRAM_NAME": error: can't resume from '%s': %s\n", path, problem);
+        return true;
+    }
+
+    const char *parameters = payload;
+    const char *optimizer_state = parameters + network->parameter_count * sizeof(double);
+    const uint64_t *order = (const uint64_t*)(optimizer_state + optimizer->state_size);
+    for (size_t entry_idx = 0; entry_idx < header.entry_count; ++entry_idx)
+        if (order[entry_idx] >= header.entry_count)
+        {
+            free(payload);
+            fprintf(stderr, PROGRAM_NAME": error: can't resume from '%s': invalid entry order\n", path);
+            return true;
+        }
+
+    memcpy(network->parameters, parameters, network->parameter_count * sizeof(double));
+    memcpy(optimizer->state, optimizer_state, optimizer->state_size);
+    for (size_t entry_idx = 0; entry_idx < header.entry_count; ++entry_idx)
+        position->order[entry_idx] = order[entry_idx];
+    free(payload);
+
+    optimizer->t = header.t;
+    position->epoch_idx = header.epoch_idx;
+    position->entry_idx = header.entry_idx;
+    position->epoch_evaluated = header.epoch_evaluated;
+    position->epoch_loss = header.epoch_loss;
+    position->epoch_accuracy = header.epoch_accuracy;
+    memcpy(position->random_state, header.random_state, sizeof(position->random_state));
+    return false;
+}
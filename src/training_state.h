@@ -0,0 +1,42 @@
+#ifndef TRAINING_STATE_H
+#define TRAINING_STATE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "math_utils.h"
+
+typedef struct neural_network neural_network;
+typedef struct optimizer optimizer;
+
+// Where a training run stands between two optimizer steps: together with the parameters
+// and the optimizer state, everything needed to resume it with bit-identical results.
+typedef struct training_position {
+    size_t epoch_idx;
+    size_t entry_idx;    // Next training entry of the epoch, whose shuffle is already done
+    size_t entry_count;
+    size_t *order;       // Shuffled training entry indices of the epoch
+    size_t batch_size, accumulation_steps; // Must match on resume
+    bool epoch_evaluated;                  // Whether the validation row below was computed at the start of the epoch
+    double epoch_loss, epoch_accuracy;
+    char random_state[RANDOM_STATE_SIZE];
+} training_position;
+
+// Writes training states to a file from a background thread. Each snapshot is copied into
+// one of two buffers, so that the training loop only waits for memory copies: while one
+// buffer is being written, the other holds the latest snapshot still to be written, which
+// a newer snapshot replaces. Each file is written to a temporary name, synced, then renamed
+// over the previous one, so that a crash always leaves a complete state behind.
+typedef struct training_state_writer training_state_writer;
+
+training_state_writer* training_state_writer_create(const char *path, const neural_network *network, const optimizer *optimizer, size_t entry_count);
+void training_state_snapshot(training_state_writer *writer, const neural_network *network, const optimizer *optimizer, const training_position *position);
+// Waits for the pending snapshot to be written.
+void training_state_writer_free(training_state_writer *writer);
+
+// Restores a state written for the same network layout, optimizer and training set. The
+// network and optimizer are left untouched unless the whole file is valid.
+// Returns true on failure, after printing the reason.
+int training_state_load(const char *path, neural_network *network, optimizer *optimizer, training_position *position);
+
+#endif // TRAINING_STATE_H
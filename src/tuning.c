@@ -0,0 +1,370 @@
+#include "tuning.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "layer.h"
+#include "batch_buffer.h"
+#include "constants.h"
+
+#define CPU_MODEL_SIZE 128
+#define ACTIVATION_NAME_SIZE 16
+
+typedef struct tuning_entry {
+    char cpu_model[CPU_MODEL_SIZE];
+    size_t input_size, output_size;
+    char activation[ACTIVATION_NAME_SIZE]; // Sets the forward tile candidates and epilogue cost
+    kernel_config config;
+    bool timed; // By this run
+} tuning_entry;
+
+typedef struct tuning_cache {
+    size_t entry_count, capacity;
+    tuning_entry *entries;
+} tuning_cache;
+
+// Candidates: tiles are multiples of the sign mask words, blocks those of batch_buffer.c.
+static const size_t tile_sizes[] = {64, 128, 256, 512};
+static const size_t block_sizes[] = {1, 2, 4};
+
+#define COUNT(table) (sizeof(table) / sizeof(*(table)))
+
+// The "model name" of /proc/cpuinfo, or "unknown" where there is none.
+static void read_cpu_model(char model[CPU_MODEL_SIZE])
+{
+    strcpy(model, "unknown");
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (!file) return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char *value = strchr(line, ':');
+        if (strncmp(line, "model name", strlen("model name")) || !value)
+            continue;
+        value += 1 + strspn(value + 1, " \t");
+        size_t length = strcspn(value, "\n");
+        if (length >= CPU_MODEL_SIZE)
+            length = CPU_MODEL_SIZE - 1;
+        if (length)
+        {
+            memcpy(model, value, length);
+            model[length] = '\0';
+        }
+        break;
+    }
+    fclose(file);
+}
+
+static tuning_entry *find_entry(tuning_cache *cache, const char *cpu_model, size_t input_size, size_t output_size, const char *activation)
+{
+    for (size_t idx = 0; idx < cache->entry_count; ++idx)
+    {
+        tuning_entry *entry = &cache->entries[idx];
+        if (entry->input_size == input_size && entry->output_size == output_size
+            && !strcmp(entry->activation, activation) && !strcmp(entry->cpu_model, cpu_model))
+            return entry;
+    }
+    return NULL;
+}
+
+static tuning_entry *add_entry(tuning_cache *cache)
+{
+    if (cache->entry_count == cache->capacity)
+    {
+        size_t capacity = cache->capacity ? 2 * cache->capacity : 16;
+        tuning_entry *entries = realloc(cache->entries, capacity * sizeof(tuning_entry));
+        if (!entries)
+        {
+            fprintf(stderr, PROGRAM_NAME": error: out of memory\n");
+            return NULL;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    tuning_entry *entry = &cache->entries[cache->entry_count++];
+    *entry = (tuning_entry) {0};
+    return entry;
+}
+
+// A missing file is an empty cache. Lines without an activation, written before it was part of
+// the key, are dropped so that their shapes are timed again.
+static int load_cache(const char *path, tuning_cache *cache)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        if (errno == ENOENT)
+            return false;
+        fprintf(stderr, PROGRAM_NAME": error: can't open '%s': %s\n", path, strerror(errno));
+        return true;
+    }
+
+    char line[CPU_MODEL_SIZE + 256];
+    for (size_t line_idx = 1; fgets(line, sizeof(line), file); ++line_idx)
+    {
+        if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+            continue;
+
+        tuning_entry entry = {0};
+        kernel_config *config = &entry.config;
+        int model_offset = 0;
+        line[strcspn(line, "\n")] = '\0';
+        int activation_offset = 0;
+        if (sscanf(line, "%zu %zu %n", &entry.input_size, &entry.output_size, &activation_offset) == 2
+            && isdigit((unsigned char)line[activation_offset]))
+            continue;
+        if (sscanf(line, "%zu %zu %15s %zu %zu %zu %zu %n", &entry.input_size, &entry.output_size, entry.activation,
+                &config->forward_tile, &config->forward_block, &config->backward_tile, &config->backward_block, &model_offset) < 7
+            || !model_offset || !line[model_offset] || strlen(line + model_offset) >= CPU_MODEL_SIZE)
+        {
+            fprintf(stderr, PROGRAM_NAME": error: malformed line %zu in '%s'\n", line_idx, path);
+            fclose(file);
+            return true;
+        }
+        strcpy(entry.cpu_model, line + model_offset);
+
+        tuning_entry *slot = add_entry(cache);
+        if (!slot)
+        {
+            fclose(file);
+            return true;
+        }
+        *slot = entry;
+    }
+    fclose(file);
+    return false;
+}
+
+// Written next to the cache, then renamed over it, so that an interrupted save leaves the old one.
+static int save_cache(const char *path, const tuning_cache *cache)
+{
+    size_t path_length = strlen(path);
+    char *temporary_path = malloc(path_length + sizeof(".tmp"));
+    if (!temporary_path)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: out of memory\n");
+        return true;
+    }
+    memcpy(temporary_path, path, path_length);
+    strcpy(temporary_path + path_length, ".tmp");
+
+    FILE *file = fopen(temporary_path, "w");
+    if (!file)
+    {
+        fprintf(stderr, PROGRAM_NAME": error: can't open '%s': %s\n", temporary_path, strerror(errno));
+        free(temporary_path);
+        return true;
+    }
+    fprintf(file, TUNING_CACHE_HEADER"\n");
+    for (size_t idx = 0; idx < cache->entry_count; ++idx)
+    {
+        const tuning_entry *entry = &cache->entries[idx];
+        const kernel_config *config = &entry->config;
+        fprintf(file, "%zu %zu %s %zu %zu %zu %zu %s\n", entry->input_size, entry->output_size, entry->activation,
+            config->forward_tile, config->forward_block, config->backward_tile, config->backward_block, entry->cpu_model);
+    }
+
+    int failed = ferror(file);
+    failed = fclose(file) || failed;
+    if (failed || rename(temporary_path, path))
+    {
+        fprintf(stderr, PROGRAM_NAME": error: failed to write '%s'\n", path);
+        remove(temporary_path);
+        free(temporary_path);
+        return true;
+    }
+    free(temporary_path);
+    return false;
+}
+
+static double seconds(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// The network timed for one shape: its last layer has the shape. For the backward step, a ReLU
+// layer comes first, so that the step has a tiled derivative epilogue, as most layers have.
+typedef struct benchmark {
+    neural_network *network;
+    double *input;
+    bool backward;
+} benchmark;
+
+static void run_step(batch_buffer *buffer, const benchmark *bench)
+{
+    if (bench->backward)
+        batch_buffer_backpropagate_layer(buffer, bench->network->layer_count - 1);
+    else
+        batch_buffer_infer(buffer, bench->input);
+}
+
+// Seconds per step with the candidate configuration, the best of TUNING_ROUNDS rounds;
+// a negative time when the buffers could not be allocated.
+static double time_candidate(const benchmark *bench, const kernel_config *candidate)
+{
+    const neural_network *network = bench->network;
+    layer *tuned = network->layers[network->layer_count - 1];
+    tuned->kernel = *candidate;
+
+    batch_arena *arena = batch_arena_create(network, 1, false, 1, INPUT_FORMAT_DENSE);
+    if (!arena) return -1;
+    batch_buffer *buffer = arena->samples[0];
+    batch_arena_forward(arena, 0, bench->input);
+    for (size_t neuron = 0; neuron < tuned->output_size; ++neuron)
+        buffer->layers[network->layer_count - 1]->local_gradients[neuron] = 1e-3 * (neuron % 7);
+
+    // Enough repetitions for each round to take its share of the time.
+    size_t repetitions = 1;
+    for (double elapsed = 0; elapsed < TUNING_SECONDS_PER_CANDIDATE / TUNING_ROUNDS / 4; repetitions *= 2)
+    {
+        double start = seconds();
+        for (size_t repetition = 0; repetition < repetitions; ++repetition)
+            run_step(buffer, bench);
+        elapsed = seconds() - start;
+    }
+    repetitions *= 2;
+
+    double best = INFINITY;
+    for (size_t round = 0; round < TUNING_ROUNDS; ++round)
+    {
+        double start = seconds();
+        for (size_t repetition = 0; repetition < repetitions; ++repetition)
+            run_step(buffer, bench);
+        double elapsed = (seconds() - start) / repetitions;
+        best = elapsed < best ? elapsed : best;
+    }
+    batch_arena_free(arena);
+    return best;
+}
+
+// Times every tile and block pair of one direction; tiles past the size are all the same one.
+static int tune_direction(const benchmark *bench, size_t tiled_size, bool tiled, size_t *best_tile, size_t *best_block)
+{
+    double best_time = INFINITY;
+    for (size_t tile_idx = 0; tile_idx < COUNT(tile_sizes); ++tile_idx)
+    {
+        if (tile_idx > 0 && (!tiled || tile_sizes[tile_idx - 1] >= tiled_size))
+            break;
+        for (size_t block_idx = 0; block_idx < COUNT(block_sizes); ++block_idx)
+        {
+            kernel_config candidate = {0};
+            size_t *tile = bench->backward ? &candidate.backward_tile : &candidate.forward_tile;
+            size_t *block = bench->backward ? &candidate.backward_block : &candidate.forward_block;
+            *tile = tile_sizes[tile_idx];
+            *block = block_sizes[block_idx];
+
+            double time = time_candidate(bench, &candidate);
+            if (time < 0)
+                return true;
+            if (time < best_time)
+            {
+                best_time = time;
+                *best_tile = *tile;
+                *best_block = *block;
+            }
+        }
+    }
+    return false;
+}
+
+static neural_network *create_benchmark_network(const layer *shape, bool backward)
+{
+    struct layer_layout layers[2] = {
+        {shape->input_size, shape->initialization_function, activation_relu, LAYER_DENSE, 0},
+        {shape->output_size, shape->initialization_function, shape->activation_pair, LAYER_DENSE, 0}
+    };
+    network_layout layout = {
+        .input_size = shape->input_size,
+        .layer_count = backward ? 2 : 1,
+        .layers = backward ? layers : layers + 1
+    };
+    neural_network *network = network_create(&layout);
+    if (network)
+        network_initialize(network, 0);
+    return network;
+}
+
+static int tune_shape(const layer *shape, kernel_config *config)
+{
+    double *input = malloc(shape->input_size * sizeof(double));
+    neural_network *forward_network = create_benchmark_network(shape, false);
+    neural_network *backward_network = create_benchmark_network(shape, true);
+    int failed = !input || !forward_network || !backward_network;
+    if (!failed)
+    {
+        for (size_t input_idx = 0; input_idx < shape->input_size; ++input_idx)
+            input[input_idx] = (double)(input_idx % 13) / 13 - 0.5;
+
+        benchmark forward = {forward_network, input, false};
+        benchmark backward = {backward_network, input, true};
+        failed = tune_direction(&forward, shape->output_size, shape->activation_pair.base_tile, &config->forward_tile, &config->forward_block)
+            || tune_direction(&backward, shape->input_size, true, &config->backward_tile, &config->backward_block);
+    }
+    if (failed)
+        fprintf(stderr, PROGRAM_NAME": error: failed to allocate the tuning benchmark\n");
+
+    free(input);
+    if (forward_network)
+        network_free(forward_network);
+    if (backward_network)
+        network_free(backward_network);
+    return failed;
+}
+
+int tuning_apply(neural_network *network, const char *cache_path, bool retune)
+{
+    tuning_cache cache = {0};
+    if (load_cache(cache_path, &cache))
+    {
+        free(cache.entries);
+        return true;
+    }
+
+    char cpu_model[CPU_MODEL_SIZE];
+    read_cpu_model(cpu_model);
+
+    bool timed = false;
+    for (size_t layer_idx = 0; layer_idx < network->layer_count; ++layer_idx)
+    {
+        layer *layer = network->layers[layer_idx];
+        if (layer->type != LAYER_DENSE)
+            continue; // Table lookups have no loops to tune
+        const char *activation = activation_name(&layer->activation_pair);
+        tuning_entry *entry = find_entry(&cache, cpu_model, layer->input_size, layer->output_size, activation);
+        if (!entry || (retune && !entry->timed))
+        {
+            kernel_config config = {0};
+            if (tune_shape(layer, &config) || (!entry && !(entry = add_entry(&cache))))
+            {
+                free(cache.entries);
+                return true;
+            }
+            *entry = (tuning_entry) {
+                .input_size = layer->input_size,
+                .output_size = layer->output_size,
+                .config = config,
+                .timed = true
+            };
+            strcpy(entry->activation, activation);
+            strcpy(entry->cpu_model, cpu_model);
+            timed = true;
+        }
+
+        layer->kernel = entry->config;
+        printf("Layer %zu, %zu -> %zu %s: forward tile %zu block %zu, backward tile %zu block %zu%s\n",
+            layer_idx, layer->input_size, layer->output_size, activation, layer->kernel.forward_tile, layer->kernel.forward_block,
+            layer->kernel.backward_tile, layer->kernel.backward_block, entry->timed ? " (tuned)" : "");
+    }
+
+    int failed = timed && save_cache(cache_path, &cache);
+    free(cache.entries);
+    return failed;
+}
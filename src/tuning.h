@@ -0,0 +1,24 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdbool.h>
+
+#include "network.h"
+
+// Autotuning of the dense kernels: each candidate kernel_config is timed on the forward and
+// backward steps of a layer shape, and the fastest is kept. Results go into a text cache, one
+// line per processor model and shape, whose activation sets the forward tile candidates:
+//   <input size> <output size> <activation> <forward tile> <forward block> <backward tile> <backward block> <processor model>
+// Lines of other processors are kept when the cache is rewritten.
+#define TUNING_CACHE_HEADER "# network kernel tuning cache"
+
+// Seconds spent timing each candidate, split over TUNING_ROUNDS rounds of which the best counts.
+#define TUNING_SECONDS_PER_CANDIDATE 0.004
+#define TUNING_ROUNDS 3
+
+// Gives every layer of the network the configuration cached for its shape on this processor,
+// timing the shapes missing from the cache, or all of them with retune, and saving the cache
+// when anything was timed. Returns true on failure, after printing the reason.
+int tuning_apply(neural_network *network, const char *cache_path, bool retune);
+
+#endif // TUNING_H
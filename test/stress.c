@@ -0,0 +1,230 @@
+// Concurrency stress test of inference: THREAD_COUNT threads share one loaded model, each with
+// its own contexts, and every output they compute must be bit for bit the one of a serial run.
+// Each thread goes through nn_infer, nn_infer_batch and network_infer in turn, on batches of
+// its own sizes, so the compiled passes of every arena kind run concurrently.
+//
+// Built against the objects of libnn by `make stress`, which runs it; exits with failure on any mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "nn.h"
+#include "network.h"
+#include "model_file.h"
+#include "batch_buffer.h"
+#include "loss.h"
+
+#define THREAD_COUNT 48
+#define INPUT_COUNT 64
+#define ROUND_COUNT 300
+#define MAX_BATCH_SIZE 8
+
+typedef struct stress_case {
+    const char *name;
+    network_layout layout;
+    struct layer_layout layers[3];
+    double zero_fraction; // Of the dense inputs, so that the sparse kernels run on some samples
+} stress_case;
+
+typedef struct worker {
+    const nn_model *model;
+    const neural_network *network; // The same model, loaded for network_infer
+    const double *inputs;
+    const double *expected;
+    size_t input_size, output_size;
+    size_t thread_idx;
+    size_t inference_count, mismatch_count;
+    bool failed;
+} worker;
+
+static struct layer_layout dense(size_t units, initialization_function initialization, activation_pair activation)
+{
+    return (struct layer_layout) {units, initialization, activation, LAYER_DENSE, 0};
+}
+
+static size_t fill_cases(stress_case cases[])
+{
+    size_t count = 0;
+
+    cases[count] = (stress_case) {.name = "dense, exact activations", .layout = {.input_size = 64, .layer_count = 3}};
+    cases[count].layers[0] = dense(128, initialization_xavier, activation_tanh);
+    cases[count].layers[1] = dense(64, initialization_he, activation_relu);
+    cases[count++].layers[2] = dense(4, initialization_xavier, activation_softmax);
+
+    cases[count] = (stress_case) {.name = "dense, table activations", .layout = {.input_size = 64, .layer_count = 3,
+        .inference_activations = ACTIVATION_BACKEND_TABLE}};
+    cases[count].layers[0] = dense(128, initialization_xavier, activation_sigmoid);
+    cases[count].layers[1] = dense(64, initialization_he, activation_swish);
+    cases[count++].layers[2] = dense(4, initialization_xavier, activation_softmax);
+
+    cases[count] = (stress_case) {.name = "mostly zero inputs", .layout = {.input_size = 1024, .layer_count = 2},
+        .zero_fraction = 0.9};
+    cases[count].layers[0] = dense(256, initialization_he, activation_leaky_relu);
+    cases[count++].layers[1] = dense(4, initialization_xavier, activation_softmax);
+
+    // Ids are drawn past both ends of the vocabulary and between integers as well.
+    cases[count] = (stress_case) {.name = "embedding", .layout = {.input_size = 4, .layer_count = 3}};
+    cases[count].layers[0] = (struct layer_layout) {16, initialization_xavier, activation_linear, LAYER_EMBEDDING, 1000};
+    cases[count].layers[1] = dense(32, initialization_he, activation_relu);
+    cases[count++].layers[2] = dense(4, initialization_xavier, activation_softmax);
+
+    for (size_t case_idx = 0; case_idx < count; ++case_idx)
+        cases[case_idx].layout.layers = cases[case_idx].layers;
+    return count;
+}
+
+static void fill_inputs(const stress_case *test, double *inputs)
+{
+    size_t input_size = test->layout.input_size;
+    bool ids = test->layers[0].type == LAYER_EMBEDDING;
+    for (size_t idx = 0; idx < INPUT_COUNT * input_size; ++idx)
+    {
+        double uniform = (double)rand() / RAND_MAX;
+        if (ids)
+            inputs[idx] = idx % 7 == 0 ? uniform * 4 - 2 : (double)(rand() % (test->layers[0].vocabulary_size + 2)) - 1;
+        else
+            inputs[idx] = uniform < test->zero_fraction ? 0 : 2 * (double)rand() / RAND_MAX - 1;
+    }
+}
+
+static bool same_rows(const double *outputs, const double *expected, size_t size)
+{
+    return !memcmp(outputs, expected, size * sizeof(double));
+}
+
+static void *run_worker(void *argument)
+{
+    worker *work = argument;
+    size_t input_size = work->input_size, output_size = work->output_size;
+    nn_context *context = NULL;
+    batch_arena *arena = network_inference_context_create(work->network);
+    double *outputs = malloc(MAX_BATCH_SIZE * output_size * sizeof(double));
+    if (nn_context_create(work->model, MAX_BATCH_SIZE, &context) || !arena || !outputs)
+    {
+        work->failed = true;
+        goto done;
+    }
+
+    for (size_t round = 0; round < ROUND_COUNT; ++round)
+    {
+        size_t batch_size = 1 + (work->thread_idx + round) % MAX_BATCH_SIZE;
+        size_t first = (work->thread_idx * 7 + round * 5) % (INPUT_COUNT - batch_size + 1);
+        const double *inputs = work->inputs + first * input_size;
+        switch (round % 3)
+        {
+        case 0:
+            work->failed |= nn_infer_batch(context, batch_size, inputs, outputs) != NN_OK;
+            break;
+        case 1:
+            for (size_t row = 0; row < batch_size; ++row)
+                work->failed |= nn_infer(context, inputs + row * input_size, outputs + row * output_size) != NN_OK;
+            break;
+        default:
+            for (size_t row = 0; row < batch_size; ++row)
+                network_infer(work->network, arena, inputs + row * input_size, outputs + row * output_size);
+        }
+        for (size_t row = 0; row < batch_size; ++row)
+            work->mismatch_count += !same_rows(outputs + row * output_size, work->expected + (first + row) * output_size, output_size);
+        work->inference_count += batch_size;
+    }
+
+done:
+    nn_context_free(context);
+    batch_arena_free(arena);
+    free(outputs);
+    return NULL;
+}
+
+// Saves the case's network, loads it twice and compares the threads with a serial run; true on failure.
+static bool run_case(const stress_case *test)
+{
+    char path[] = "/tmp/nn_stress_XXXXXX";
+    int descriptor = mkstemp(path);
+    if (descriptor < 0)
+    {
+        perror("stress: mkstemp");
+        return true;
+    }
+    close(descriptor);
+
+    network_layout layout = test->layout;
+    neural_network *created = network_create(&layout);
+    if (!created)
+    {
+        remove(path);
+        return true;
+    }
+    network_initialize(created, 7);
+    created->loss = &loss_cce_softmax;
+    bool failed = network_save(created, path);
+    network_free(created);
+
+    nn_model *model = NULL;
+    neural_network *network = failed ? NULL : network_load(path);
+    size_t input_size = test->layout.input_size;
+    size_t output_size = network ? network->layers[network->layer_count - 1]->output_size : 0;
+    double *inputs = malloc(INPUT_COUNT * input_size * sizeof(double));
+    double *expected = malloc(INPUT_COUNT * output_size * sizeof(double));
+    nn_context *context = NULL;
+    failed = !network || !inputs || !expected || nn_model_load(path, &model) || nn_context_create(model, 1, &context);
+
+    worker workers[THREAD_COUNT];
+    pthread_t threads[THREAD_COUNT];
+    size_t started = 0;
+    if (!failed)
+    {
+        fill_inputs(test, inputs);
+        for (size_t row = 0; row < INPUT_COUNT && !failed; ++row)
+            failed = nn_infer(context, inputs + row * input_size, expected + row * output_size) != NN_OK;
+
+        for (; !failed && started < THREAD_COUNT; ++started)
+        {
+            workers[started] = (worker) {
+                .model = model,
+                .network = network,
+                .inputs = inputs,
+                .expected = expected,
+                .input_size = input_size,
+                .output_size = output_size,
+                .thread_idx = started
+            };
+            failed = pthread_create(&threads[started], NULL, run_worker, &workers[started]) != 0;
+        }
+    }
+
+    size_t inference_count = 0, mismatch_count = 0;
+    for (size_t thread_idx = 0; thread_idx < started; ++thread_idx)
+    {
+        pthread_join(threads[thread_idx], NULL);
+        failed |= workers[thread_idx].failed;
+        inference_count += workers[thread_idx].inference_count;
+        mismatch_count += workers[thread_idx].mismatch_count;
+    }
+    if (started == THREAD_COUNT)
+        printf("%s: %d threads, %zu inferences, %zu mismatches\n", test->name, THREAD_COUNT, inference_count, mismatch_count);
+    if (failed)
+        fprintf(stderr, "stress: %s: setup or inference failed\n", test->name);
+
+    nn_context_free(context);
+    nn_model_free(model);
+    if (network)
+        network_free(network);
+    free(inputs);
+    free(expected);
+    remove(path);
+    return failed || mismatch_count;
+}
+
+int main(void)
+{
+    stress_case cases[4];
+    size_t case_count = fill_cases(cases);
+    bool failed = false;
+    for (size_t case_idx = 0; case_idx < case_count; ++case_idx)
+        failed |= run_case(&cases[case_idx]);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}